@@ -1,7 +1,50 @@
+#define _GNU_SOURCE //memfd_create
 #include "vpx2.c"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include "vpx_snapshot.c"
+#include "vpx_clone.c"
+#include "vpx_checkpoint.c"
+#include "vpx_lz.c"
+#include "vpx_image.c"
+#include "vpx_stream.c"
+#include "vpx_files.c"
+#include "vpx_io.c"
+#include "vpx_console.c"
+#include "vpx_async.c"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+//[[ OPTIONS ]]
+const char* opt_snapshot_path = NULL; //--snapshot <file>, written when the guest does hostcall 2.
+uint32_t opt_clones = 0; //--clones <n>, run n copy-on-write clones from hostcall 2.
+uint32_t opt_reuse = 0; //--reuse <n>, run n times on one VM from hostcall 2, dirty pages reset in between.
+uint32_t opt_many = 0; //--many <n>, run n clones from hostcall 2 interleaved on this thread.
+uint32_t opt_batch = 0; //--batch <n>, run n clones from hostcall 2 in lockstep lanes (VPX_BATCH).
+uint32_t opt_interleave = 0; //--interleave <n>, run n clones from hostcall 2 taking turns a block at a time (VPX_INTERLEAVE).
+const char* opt_checkpoint_path = NULL; //--checkpoint <file>, incremental checkpoints while running.
+uint32_t opt_slice = 1u << 20; //--slice <n>, blocks per vpx2_run, --many switches VMs and checkpoints are polled in between.
+uint64_t opt_max_blocks = 0; //--max-blocks <n>, stop a runaway guest after about n blocks. 0 is no limit.
+uint32_t opt_timeout_ms = 0; //--timeout <ms>, wall clock limit enforced from a watchdog thread. 0 is no limit.
+uint32_t opt_timer = 0; //--timer <blocks>, period of the guest timer trap (VPX_TRAPS). 0 is off.
+
+//[[ HOSTCALL STATUS ]]
+#define HOSTCALL_OK 0
+#define HOSTCALL_INVALID 1
+#define HOSTCALL_EXIT 2 //Guest is done, exit code in guest_exit_code.
+#define HOSTCALL_PENDING 3 //Would block, hostcall_pending says on what. The VM resumes after the hostcall.
+
+#include "vpx_harts.c"
+#include "vpx_chan.c"
+#include "vpx_pipe.c"
+#include "vpx_udf.c"
+#include "vpx_park.c"
+#include "vpx_ring.c" //Needs the status codes above.
+
+VPX_HART_LOCAL uint32_t guest_exit_code = 0;
 
 
 uint32_t get_file_size(FILE* file){
@@ -12,34 +55,934 @@ uint32_t get_file_size(FILE* file){
     return size;
 }
 
+uint8_t hostcall_args(uint32_t* args, uint32_t count){
+    //Reads count 32 bit arguments from the array r60 points to. Returns 0 if it's inside guest memory.
+    uint32_t adr = vpx2_rreg(60);
+    if((uint64_t)adr + count * 4 > vpx2_mem_size){
+        return 1;
+    }
+    for(uint32_t i = 0; i < count; i++){
+        args[i] = vpx2_mem_r32(adr + i * 4);
+    }
+    return 0;
+}
+
+int32_t run_clones(uint32_t count);
+int32_t run_reuse(uint32_t count);
+int32_t run_many(uint32_t count);
+int32_t run_batch(uint32_t count);
+int32_t run_interleave(uint32_t count);
+uint32_t sort_guest(uint32_t base, uint32_t count, uint32_t size, uint32_t cmp);
+
 uint8_t execute_hostcall(uint32_t hostcall){
     //Register 61 is for the hostcall code.
     //register 60 for arguments (array ptr if multiple.)
     switch(hostcall){
-        default: return 1; //error
-        case 0: exit(vpx2_rreg(60)); break;
-        case 1: putchar('T'); break; //Debug
+        default: return HOSTCALL_INVALID; //error
+        case 0: guest_exit_code = vpx2_rreg(60); return HOSTCALL_EXIT;
+        case 1: console_put('T'); break; //Debug
+        case 2: {
+            //Snapshot point, the guest is done initializing.
+            //With --snapshot the state is dumped and vpx-run exits, a --restore resumes right after this hostcall.
+            //With --clones the warmed VM becomes a template and the clones run instead of it.
+            //With --reuse the warmed VM is kept as the pristine copy and reset after each run.
+            //With --many the clones all run at once, switching whenever one parks. Each gets its index in r60.
+            //With --batch the clones run in lockstep lanes, also with their index in r60.
+            //With --interleave they take turns a block at a time on this thread, same index in r60.
+            //Without any of them this is a no-op.
+            if(opt_snapshot_path != NULL){
+                if(snapshot_save(opt_snapshot_path) != 0){
+                    printf("failed to write snapshot: %s\n", opt_snapshot_path);
+                    exit(1);
+                }
+                exit(0);
+            }
+            if(opt_clones != 0){
+                int32_t code = run_clones(opt_clones);
+                exit(code < 0 ? 1 : code);
+            }
+            if(opt_reuse != 0){
+                int32_t code = run_reuse(opt_reuse);
+                exit(code < 0 ? 1 : code);
+            }
+            if(opt_many != 0){
+                int32_t code = run_many(opt_many);
+                exit(code < 0 ? 1 : code);
+            }
+            if(opt_batch != 0){
+                int32_t code = run_batch(opt_batch);
+                exit(code < 0 ? 1 : code);
+            }
+            if(opt_interleave != 0){
+                int32_t code = run_interleave(opt_interleave);
+                exit(code < 0 ? 1 : code);
+            }
+            break;
+        }
+        case 3: //Map input file window, r60 -> {file, addr, len, offset_lo, offset_hi}, r60 = mapped length
+        case 4: { //Map output file window, same arguments
+            uint32_t args[5];
+            if(hostcall_args(args, 5) != 0){return HOSTCALL_INVALID;}
+            uint64_t offset = args[3] | ((uint64_t)args[4] << 32);
+            vpx2_wreg(60, files_map(hostcall == 4, args[0], args[1], args[2], offset));
+            break;
+        }
+        case 5: { //Final output file size, r60 -> {file, size_lo, size_hi}, r60 = 0 or VPX_FILE_ERR
+            uint32_t args[3];
+            if(hostcall_args(args, 3) != 0){return HOSTCALL_INVALID;}
+            vpx2_wreg(60, files_set_size(args[0], args[1] | ((uint64_t)args[2] << 32)) == 0 ? 0 : VPX_FILE_ERR);
+            break;
+        }
+        //[[ FILE I/O ]]
+        //Result in r60, VPX_IO_ERR on failure with errno in r59.
+        case 6: //open, r60 -> {path_ptr, path_len, mode}
+        case 7: //read, r60 -> {fd, ptr, len}
+        case 8: //write, r60 -> {fd, ptr, len}
+        case 9: //pread, r60 -> {fd, ptr, len, offset_lo, offset_hi}
+        case 10: //pwrite, same as pread
+        case 11: //close, r60 -> {fd}
+        case 12: //readv, r60 -> {fd, pairs_ptr, pair_count}, pairs are {ptr, len}
+        case 13: { //writev, same as readv
+            uint32_t args[5];
+            uint32_t count = hostcall == 11 ? 1 : (hostcall == 9 || hostcall == 10) ? 5 : 3;
+            if(hostcall_args(args, count) != 0){return HOSTCALL_INVALID;}
+            if((hostcall == 8 || hostcall == 10 || hostcall == 13) && (args[0] == 1 || args[0] == 2)){
+                console_flush(); //Text from 1 and 14-17 comes first. Guest fds 1 and 2 are always the host's.
+            }
+            uint32_t rt;
+            switch(hostcall){
+                case 6: rt = io_open(args[0], args[1], args[2]); break;
+                case 7: rt = io_rw(0, args[0], args[1], args[2], -1); break;
+                case 8: rt = io_rw(1, args[0], args[1], args[2], -1); break;
+                case 9: rt = io_rw(0, args[0], args[1], args[2], args[3] | ((int64_t)(args[4] & 0x7FFFFFFF) << 32)); break;
+                case 10: rt = io_rw(1, args[0], args[1], args[2], args[3] | ((int64_t)(args[4] & 0x7FFFFFFF) << 32)); break;
+                case 11: rt = io_close(args[0]); break;
+                case 12: rt = io_rwv(0, args[0], args[1], args[2]); break;
+                default: rt = io_rwv(1, args[0], args[1], args[2]); break;
+            }
+            vpx2_wreg(60, rt);
+            if(rt == VPX_IO_ERR){
+                vpx2_wreg(59, io_errno());
+            }
+            break;
+        }
+        //[[ CONSOLE ]]
+        case 14: { //Write text, r60 -> {ptr, len}, r60 = len or VPX_IO_ERR
+            uint32_t args[2];
+            if(hostcall_args(args, 2) != 0){return HOSTCALL_INVALID;}
+            const uint8_t* text = vpx2_mem_host(args[0], args[1], 0);
+            if(text == VPXNULL){
+                vpx2_wreg(60, VPX_IO_ERR);
+                break;
+            }
+            console_write((const char*)text, args[1]);
+            vpx2_wreg(60, args[1]);
+            break;
+        }
+        case 15: console_int(vpx2_rreg(60), 0); break; //Print r60 as unsigned decimal
+        case 16: console_int(vpx2_rreg(60), 1); break; //Print r60 as signed decimal
+        case 17: console_int(vpx2_rreg(60), 2); break; //Print r60 as hex
+        //[[ ASYNC FILE I/O ]]
+        case 18: //Async pread, r60 -> {fd, ptr, len, offset_lo, offset_hi}, r60 = ticket
+        case 19: { //Async pwrite, same arguments
+            uint32_t args[5];
+            if(hostcall_args(args, 5) != 0){return HOSTCALL_INVALID;}
+            uint32_t rt = async_submit(hostcall == 19, args[0], args[1], args[2], args[3] | ((uint64_t)args[4] << 32));
+            vpx2_wreg(60, rt);
+            if(rt == VPX_IO_ERR){
+                vpx2_wreg(59, io_errno());
+            }
+            break;
+        }
+        case 20: //Poll ticket r60, r60 = VPX_ASYNC_PENDING or the result like hostcall 9
+        case 21: { //Wait for ticket r60, r60 = result. Parks the VM.
+            uint32_t rt = async_collect(vpx2_rreg(60), 0);
+            if(rt == VPX_ASYNC_PENDING && hostcall == 21){
+                hostcall_pending.kind = VPX_PEND_TICKET;
+                hostcall_pending.ticket = vpx2_rreg(60);
+                return HOSTCALL_PENDING;
+            }
+            vpx2_wreg(60, rt);
+            if(rt == VPX_IO_ERR){
+                vpx2_wreg(59, io_errno());
+            }
+            break;
+        }
+        case 24: { //Sleep r60 milliseconds, r60 = 0. Parks the VM.
+            hostcall_pending.kind = VPX_PEND_TIMER;
+            hostcall_pending.deadline_ns = park_now_ns() + (uint64_t)vpx2_rreg(60) * 1000000u;
+            return HOSTCALL_PENDING;
+        }
+        //[[ HOSTCALL RINGS ]]
+        case 22: { //Set up the ring, r60 -> {ring_addr, entries}, r60 = 0 or VPX_IO_ERR
+            uint32_t args[2];
+            if(hostcall_args(args, 2) != 0){return HOSTCALL_INVALID;}
+            vpx2_wreg(60, ring_setup(args[0], args[1]) == 0 ? 0 : VPX_IO_ERR);
+            break;
+        }
+        case 23: { //Run the queued requests, r60 = number completed
+            uint32_t done;
+            uint8_t st = ring_flush(&done);
+            if(st == HOSTCALL_OK){
+                vpx2_wreg(60, done);
+            }
+            return st;
+        }
+        //[[ TRAPS ]]
+        case 25: { //Set the vector table, r60 = its address (0 turns traps off), r60 = 0 or VPX_IO_ERR
+            #ifdef VPX_TRAPS
+            if(vpx2_rreg(60) % 4 != 0 || (uint64_t)vpx2_rreg(60) + VPX_TRAP_VECTORS * 4 > vpx2_mem_size){
+                vpx2_wreg(60, VPX_IO_ERR);
+                break;
+            }
+            vpx2_ivt = vpx2_rreg(60);
+            vpx2_wreg(60, 0);
+            #else
+            vpx2_wreg(60, VPX_IO_ERR); //Not built with VPX_TRAPS.
+            #endif
+            break;
+        }
+        //[[ HARTS ]]
+        case 26: { //Start a hart, r60 -> {entry_pc, stack, arg}, r60 = hart id or VPX_IO_ERR
+            uint32_t args[3];
+            if(hostcall_args(args, 3) != 0){return HOSTCALL_INVALID;}
+            uint32_t rt = hart_start(args[0], args[1], args[2]);
+            vpx2_wreg(60, rt);
+            if(rt == VPX_IO_ERR){
+                vpx2_wreg(59, io_errno());
+            }
+            break;
+        }
+        case 27: { //Wait for hart r60 to exit, r60 = its exit code or VPX_IO_ERR. Parks the VM.
+            hostcall_pending.kind = VPX_PEND_HART;
+            hostcall_pending.ticket = vpx2_rreg(60);
+            return HOSTCALL_PENDING;
+        }
+        //[[ CHANNELS ]]
+        case 28: { //Open channel, r60 -> {chan, msg_max, slots}, r60 = 0 or VPX_IO_ERR
+            uint32_t args[3];
+            if(hostcall_args(args, 3) != 0){return HOSTCALL_INVALID;}
+            uint32_t rt = chan_open(args[0], args[1], args[2]);
+            vpx2_wreg(60, rt);
+            if(rt == VPX_IO_ERR){
+                vpx2_wreg(59, io_errno());
+            }
+            break;
+        }
+        case 29: //Send, r60 -> {chan, ptr, len}, r60 = len. Parks the VM while the channel is full.
+        case 30: //Receive, r60 -> {chan, ptr, cap}, r60 = message length. Parks the VM while it's empty.
+        case 31: //Try send, same as 29 but r60 = VPX_CHAN_AGAIN instead of parking
+        case 32: { //Try receive, same as 30 but r60 = VPX_CHAN_AGAIN instead of parking
+            uint32_t args[3];
+            if(hostcall_args(args, 3) != 0){return HOSTCALL_INVALID;}
+            uint8_t send = hostcall == 29 || hostcall == 31;
+            uint32_t rt = chan_transfer(send, args[0], args[1], args[2]);
+            if(rt == VPX_CHAN_AGAIN && hostcall <= 30){
+                hostcall_pending.kind = send ? VPX_PEND_CHAN_SEND : VPX_PEND_CHAN_RECV;
+                hostcall_pending.ticket = args[0];
+                hostcall_pending.adr = args[1];
+                hostcall_pending.len = args[2];
+                return HOSTCALL_PENDING;
+            }
+            vpx2_wreg(60, rt);
+            if(rt == VPX_IO_ERR){
+                vpx2_wreg(59, io_errno());
+            }
+            break;
+        }
+        //[[ PIPELINE ]]
+        case 33: { //Map a link, r60 -> {which, addr}, which is 0 for input, 1 for output. r60 = window bytes, r59 = buffer bytes
+            uint32_t args[2];
+            if(hostcall_args(args, 2) != 0){return HOSTCALL_INVALID;}
+            uint32_t buf = 0;
+            uint32_t rt = pipe_map(args[0], args[1], &buf);
+            vpx2_wreg(60, rt);
+            vpx2_wreg(59, rt == VPX_IO_ERR ? io_errno() : buf);
+            break;
+        }
+        case 34: { //Get a buffer from link r60, r60 = its address (0: input ended), r59 = length. Parks the VM.
+            uint32_t len = 0;
+            uint32_t rt = pipe_get(vpx2_rreg(60), &len);
+            if(rt == VPX_PIPE_AGAIN){
+                hostcall_pending.kind = VPX_PEND_PIPE;
+                hostcall_pending.ticket = vpx2_rreg(60);
+                return HOSTCALL_PENDING;
+            }
+            vpx2_wreg(60, rt);
+            vpx2_wreg(59, rt == VPX_IO_ERR ? io_errno() : len);
+            break;
+        }
+        case 35: { //Put the oldest gotten buffer back / publish it, r60 -> {which, len}, r60 = 0 or VPX_IO_ERR
+            uint32_t args[2];
+            if(hostcall_args(args, 2) != 0){return HOSTCALL_INVALID;}
+            uint32_t rt = pipe_put(args[0], args[1]);
+            vpx2_wreg(60, rt);
+            if(rt == VPX_IO_ERR){
+                vpx2_wreg(59, io_errno());
+            }
+            break;
+        }
+        //[[ RECORD UDFS ]]
+        case 36: { //Warm point for --udf, r60 -> {in_addr, in_cap, out_addr, out_cap}. r60 = VPX_IO_ERR without --udf, else it doesn't return here.
+            uint32_t args[4];
+            if(hostcall_args(args, 4) != 0){return HOSTCALL_INVALID;}
+            uint32_t rt = udf_setup(args[0], args[1], args[2], args[3]);
+            vpx2_wreg(60, rt);
+            if(rt == VPX_IO_ERR){
+                vpx2_wreg(59, io_errno());
+                break;
+            }
+            guest_exit_code = 0;
+            return HOSTCALL_EXIT; //main runs the records from here.
+        }
+        case 37: { //Record done, r60 = result length in the output buffer
+            if(!udf_ready){
+                vpx2_wreg(60, VPX_IO_ERR);
+                vpx2_wreg(59, ENOSYS);
+                break;
+            }
+            udf_result = vpx2_rreg(60);
+            udf_done = 1;
+            guest_exit_code = 0;
+            return HOSTCALL_EXIT;
+        }
+        case 38: { //Sort with a guest comparator, r60 -> {base, count, size, cmp}. r60 = 0 or VPX_IO_ERR
+            //cmp gets two element addresses in r0, r1 and returns <0, 0 or >0 (signed) in r0.
+            uint32_t args[4];
+            if(hostcall_args(args, 4) != 0){return HOSTCALL_INVALID;}
+            uint32_t rt = sort_guest(args[0], args[1], args[2], args[3]);
+            vpx2_wreg(60, rt);
+            if(rt == VPX_IO_ERR){
+                vpx2_wreg(59, io_errno());
+            }
+            break;
+        }
         //Will add other hostcalls Later for IO and whatever.
 
 
+    }
+    return HOSTCALL_OK;
+}
+
+#define VPX_RUN_PARKED -2
+#define VPX_RUN_SLICED -3
+
+VPX_HART_LOCAL uint64_t blocks_run = 0; //For --max-blocks, per hart
+
+static void report_stop(uint8_t rt){
+    //Why vpx2_run stopped, for VPX_RUN_INTERRUPTED and VPX_RUN_ERROR.
+    console_flush(); //Guest output first.
+    if(rt == VPX_RUN_INTERRUPTED){
+        printf("guest interrupted (--timeout) at RPC %u\n", vpx2_err_pc_state);
+        return;
+    }
+    printf("error during vpx execution.\n");
+    printf("error code: %hhu\n", vpx2_err_code);
+    printf("error value: %u\n", vpx2_err_val);
+    printf("RPC state: %u\n", vpx2_err_pc_state);
+}
+
+int32_t run_until_park(uint8_t sliced){
+    //Runs the loaded VM until it exits or parks on a pending hostcall, with sliced set
+    //also until its time slice (opt_slice blocks) is used up.
+    //Returns the guest exit code, -1 on error, VPX_RUN_PARKED or VPX_RUN_SLICED.
+    //[[ MAIN VPX LOOP ]]
+    while(1){
+        uint32_t slice = opt_slice;
+        #ifdef VPX_CHECKPOINTS
+        if(opt_checkpoint_path != NULL){
+            slice = checkpoint_slice(slice); //Shorter while a checkpoint is catching up.
+        }
+        #endif
+        uint8_t rt = vpx2_run(slice);
+        blocks_run += slice - vpx2_budget;
+        if(rt == VPX_RUN_INTERRUPTED || rt == VPX_RUN_ERROR){
+            report_stop(rt);
+            return -1;
+        }
+        #ifdef VPX_CHECKPOINTS
+        if(opt_checkpoint_path != NULL){
+            checkpoint_poll(); //VM is paused here anyway.
+        }
+        #endif
+        if(opt_max_blocks != 0 && blocks_run >= opt_max_blocks){
+            console_flush();
+            printf("guest ran past --max-blocks %llu, stopped at RPC %u\n", (unsigned long long)opt_max_blocks, vpx2_rreg(VPX_RPC));
+            return -1;
+        }
+        if(rt == VPX_RUN_BUDGET){
+            if(sliced){
+                return VPX_RUN_SLICED;
+            }
+            continue;
+        }
+        uint32_t hostcall_code = vpx2_rreg(61);
+        harts_lock_hostcalls();
+        uint8_t st = execute_hostcall(hostcall_code);
+        harts_unlock_hostcalls();
+        if(st == HOSTCALL_INVALID){
+            console_flush();
+            printf("attempt to execute invalid hostcall: %u", hostcall_code);
+            return -1;
+        }
+        if(st == HOSTCALL_EXIT){
+            return guest_exit_code & 0xff; //Same as what exit() would report.
+        }
+        if(st == HOSTCALL_PENDING){
+            return VPX_RUN_PARKED;
+        }
+    }
+}
+
+#ifndef _WIN32
+static void* watchdog(void* arg){
+    //Sleeps through the --timeout, then stops whatever VM is running.
+    (void)arg;
+    struct timespec ts = {opt_timeout_ms / 1000, (opt_timeout_ms % 1000) * 1000000L};
+    while(nanosleep(&ts, &ts) != 0 && errno == EINTR){}
+    vpx2_interrupt();
+    return NULL;
+}
+#endif
+
+int32_t run_vm(){
+    //Runs the loaded VM until it exits, returns the guest exit code or -1 on error.
+    //Nothing else to run, pending hostcalls just block.
+    while(1){
+        int32_t code = run_until_park(0);
+        if(code != VPX_RUN_PARKED){
+            return code;
+        }
+        pending_block(&hostcall_pending);
+    }
+}
+
+//[[ CALLS ]]
+VPX_HART_LOCAL int8_t call_stop = 0; //Why call_host stopped the call: 1 exit, -1 error
+
+static uint8_t call_host(uint8_t why){
+    //vpx2_call's host side, what run_until_park does between runs.
+    blocks_run += opt_slice - vpx2_budget;
+    if(opt_max_blocks != 0 && blocks_run >= opt_max_blocks){
+        call_stop = -1; //blocks_run stays past it, the run around this one stops and says so.
+        return 1;
+    }
+    if(why == VPX_RUN_BUDGET){
+        return 0;
+    }
+    uint32_t hostcall_code = vpx2_rreg(61);
+    harts_lock_hostcalls();
+    uint8_t st = execute_hostcall(hostcall_code);
+    harts_unlock_hostcalls();
+    if(st == HOSTCALL_INVALID){
+        console_flush();
+        printf("attempt to execute invalid hostcall: %u", hostcall_code);
+        call_stop = -1;
+        return 1;
+    }
+    if(st == HOSTCALL_EXIT){
+        call_stop = 1;
+        return 1;
+    }
+    if(st == HOSTCALL_PENDING){
+        pending_block(&hostcall_pending); //Nothing else runs until the call is back.
     }
     return 0;
 }
 
+int32_t call_vm(uint32_t entry, const uint32_t* args, uint32_t argc, uint32_t* result){
+    //Calls a guest function on the loaded VM, its hostcalls run as usual. Works from inside a
+    //hostcall handler, the guest carries on after the hostcall afterwards.
+    //Returns 0 once it returned (r0 - r7 in result), 1 if it exited instead (hostcall 0, 37...)
+    //and -1 on error.
+    int8_t outer = call_stop;
+    call_stop = 0;
+    uint8_t rt = vpx2_call(entry, args, argc, result, opt_slice, call_host);
+    int32_t code = rt == VPX_RUN_RETURNED ? 0 : call_stop > 0 ? 1 : -1;
+    if(rt == VPX_RUN_RETURNED){
+        blocks_run += opt_slice - vpx2_budget;
+        code = opt_max_blocks != 0 && blocks_run >= opt_max_blocks ? -1 : 0;
+    }
+    if(rt == VPX_RUN_ERROR){
+        report_stop(rt);
+        vpx2_err_code = 0; //The function's, not the caller's.
+    }
+    if(rt == VPX_RUN_INTERRUPTED){
+        vpx2_interrupt(); //Whatever runs this VM stops too and says so.
+    }
+    call_stop = outer;
+    return code;
+}
+
+typedef struct {
+    uint32_t base;
+    uint32_t size;
+    uint32_t cmp;
+    uint8_t failed;
+} vpx_sort;
 
-int main(int argc, char *argv[]){
+VPX_HART_LOCAL vpx_sort* sort_now = NULL; //Innermost sort_guest, a comparator can sort too.
+
+static int sort_compare(const void* a, const void* b){
+    vpx_sort* s = sort_now;
+    if(s->failed){
+        return 0;
+    }
+    uint32_t args[2] = {s->base + *(const uint32_t*)a * s->size, s->base + *(const uint32_t*)b * s->size};
+    uint32_t result[VPX_CALL_ARGS];
+    if(call_vm(s->cmp, args, 2, result) != 0){
+        s->failed = 1;
+        return 0;
+    }
+    return (int32_t)result[0] < 0 ? -1 : result[0] != 0;
+}
+
+uint32_t sort_guest(uint32_t base, uint32_t count, uint32_t size, uint32_t cmp){
+    //Hostcall 38. qsort over element numbers, the guest's comparator always sees the elements
+    //where they are and the array is only rearranged once it's done.
+    uint64_t bytes = (uint64_t)count * size;
+    if(size == 0 || base + bytes > vpx2_mem_size){
+        errno = EFAULT;
+        return VPX_IO_ERR;
+    }
+    uint32_t* order = malloc((size_t)count * sizeof(uint32_t));
+    uint8_t* sorted = malloc(bytes != 0 ? bytes : 1);
+    if(order == NULL || sorted == NULL){
+        free(order);
+        free(sorted);
+        errno = ENOMEM;
+        return VPX_IO_ERR;
+    }
+    for(uint32_t i = 0; i < count; i++){
+        order[i] = i;
+    }
+    vpx_sort s = {base, size, cmp, 0};
+    vpx_sort* outer = sort_now;
+    sort_now = &s;
+    qsort(order, count, sizeof(uint32_t), sort_compare);
+    sort_now = outer;
+
+    uint32_t rt = 0;
+    uint8_t* array = vpx2_mem_host(base, bytes, 1);
+    if(s.failed || array == VPXNULL){
+        errno = ECANCELED; //Left as it was.
+        rt = VPX_IO_ERR;
+    }else{
+        for(uint32_t i = 0; i < count; i++){
+            memcpy(sorted + (uint64_t)i * size, array + (uint64_t)order[i] * size, size);
+        }
+        memcpy(array, sorted, bytes);
+    }
+    free(order);
+    free(sorted);
+    return rt;
+}
+
+int32_t run_clones(uint32_t count){
+    //Runs count clones of the current VM one after another, returns the last exit code.
+    #ifdef __linux__
+    vpx_template tpl;
+    if(template_create(&tpl) != 0){
+        printf("failed to create clone template\n");
+        return -1;
+    }
+    int32_t code = 0;
+    for(uint32_t i = 0; i < count; i++){
+        vpx2_state st;
+        if(clone_create(&tpl, &st) != 0){
+            printf("failed to create clone %u\n", i);
+            code = -1;
+            break;
+        }
+        vpx2_state_load(&st);
+        code = run_vm();
+        clone_destroy(&st);
+        if(code < 0){break;}
+    }
+    template_destroy(&tpl);
+    return code;
+    #else
+    (void)count;
+    printf("--clones is only supported on linux\n");
+    return -1;
+    #endif
+}
+
+int32_t run_reuse(uint32_t count){
+    //Runs the current VM count times, between runs only the pages it dirtied
+    //and the registers are put back. Returns the last exit code.
+    #ifdef VPX_DIRTY
+    vpx2_state pristine;
+    vpx2_state_save(&pristine);
+    uint32_t bytes = vpx2_mem_bytes(vpx2_mem_size);
+    stream_wait_all();
+    uint8_t* pristine_mem = malloc(bytes);
+    if(pristine_mem == NULL){
+        printf("failed to allocate pristine copy: %u Bytes\n", bytes);
+        return -1;
+    }
+    memcpy(pristine_mem, vpx2_mem_ptr, bytes);
+    memset(vpx2_dirty_map, 0, VPX_DIRTY_PAGES(vpx2_mem_size));
 
-    FILE* file = fopen(argv[1], "rb"); //First argument is the file.
+    int32_t code = 0;
+    for(uint32_t i = 0; i < count; i++){
+        code = run_vm();
+        if(code < 0){break;}
+        async_release(vpx2_mem_ptr); //Tickets of the last run would write over the reset memory.
+        vpx2_reset(&pristine, pristine_mem);
+    }
+    free(pristine_mem);
+    return code;
+    #else
+    (void)count;
+    printf("--reuse needs a build with VPX_DIRTY\n");
+    return -1;
+    #endif
+}
+
+int32_t run_many(uint32_t count){
+    //Runs count clones of the current VM interleaved on this thread, a clone runs until
+    //it exits, parks or uses up its slice, then the next one that can go gets the thread.
+    //Returns the exit code of the last clone to finish.
+    #ifdef __linux__
+    vpx_template tpl;
+    if(template_create(&tpl) != 0){
+        printf("failed to create clone template\n");
+        return -1;
+    }
+    vpx2_state* vms = calloc(count, sizeof(vpx2_state));
+    vpx_pending* pending = calloc(count, sizeof(vpx_pending));
+    uint8_t* parked = calloc(count, 1);
+    uint8_t* done = calloc(count, 1);
+    int32_t code = 0;
+    uint32_t made = 0; //Clones created, the ones not done are destroyed at the end.
+    if(vms == NULL || pending == NULL || parked == NULL || done == NULL){
+        printf("failed to allocate %u VMs\n", count);
+        code = -1;
+    }
+    for(; code == 0 && made < count; made++){
+        if(clone_create(&tpl, &vms[made]) != 0){
+            printf("failed to create clone %u\n", made);
+            code = -1;
+            break;
+        }
+        vms[made].registers[60] = made; //Hostcall 2 returns the clone's index, e.g. its pipeline stage.
+    }
+
+    uint32_t alive = code == 0 ? count : 0;
+    while(alive > 0){
+        uint8_t ran = 0;
+        for(uint32_t i = 0; i < count; i++){
+            if(done[i]){continue;}
+            vpx2_state_load(&vms[i]);
+            if(parked[i]){
+                if(!pending_try(&pending[i])){continue;}
+                parked[i] = 0;
+            }
+            ran = 1;
+            int32_t rt = run_until_park(1);
+            vpx2_state_save(&vms[i]);
+            if(rt == VPX_RUN_SLICED){
+                continue; //Still runnable, others get a turn first.
+            }
+            if(rt == VPX_RUN_PARKED){
+                parked[i] = 1;
+                pending[i] = hostcall_pending;
+                continue;
+            }
+            done[i] = 1;
+            alive--;
+            code = rt;
+            clone_destroy(&vms[i]);
+            if(rt < 0){
+                alive = 0; //An error stops everything, like a lone VM.
+                break;
+            }
+        }
+        if(!ran && alive > 0){
+            //Everyone is parked. Tickets have no common wait, so nap briefly.
+            struct timespec ts = {0, 50000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    for(uint32_t i = 0; i < made; i++){
+        if(!done[i]){
+            clone_destroy(&vms[i]); //Left behind by an error.
+        }
+    }
+    template_destroy(&tpl);
+    free(vms);
+    free(pending);
+    free(parked);
+    free(done);
+    return code;
+    #else
+    (void)count;
+    printf("--many is only supported on linux\n");
+    return -1;
+    #endif
+}
+
+int32_t run_batch(uint32_t count){
+    //Runs count clones of the current VM VPX_BATCH_LANES at a time in lockstep, see [[ BATCH ]].
+    //When a clone exits the next one takes its lane. Hostcalls are done lane by lane once no
+    //lane can go on, a pending one blocks. Returns the exit code of the last clone to finish.
+    #if defined(VPX_BATCH) && defined(__linux__)
+    vpx_template tpl;
+    if(template_create(&tpl) != 0){
+        printf("failed to create clone template\n");
+        return -1;
+    }
+    vpx2_batch* b = aligned_alloc(64, sizeof(vpx2_batch));
+    if(b == NULL){
+        printf("failed to allocate batch\n");
+        template_destroy(&tpl);
+        return -1;
+    }
+    vpx2_batch_init(b);
+    uint32_t index[VPX_BATCH_LANES]; //Clone in each lane
+    uint32_t next = 0;
+    uint32_t alive = 0;
+    int32_t code = 0;
+    vpx2_state st;
+    while(next < count || alive > 0){
+        //[[ FILL LANES ]]
+        for(uint32_t l = 0; l < VPX_BATCH_LANES && next < count; l++){
+            if(b->state[l] != VPX_LANE_IDLE){continue;}
+            if(clone_create(&tpl, &st) != 0){
+                printf("failed to create clone %u\n", next);
+                code = -1;
+                break;
+            }
+            st.registers[60] = next; //Hostcall 2 returns the clone's index.
+            vpx2_batch_set(b, l, &st);
+            b->state[l] = VPX_LANE_RUN;
+            index[l] = next++;
+            alive++;
+        }
+        if(code < 0){break;}
+
+        uint8_t rt = vpx2_batch_run(b, opt_slice);
+        blocks_run += opt_slice - vpx2_budget;
+        if(rt == VPX_RUN_INTERRUPTED){
+            console_flush();
+            printf("guest interrupted (--timeout) in --batch\n");
+            code = -1;
+            break;
+        }
+        if(opt_max_blocks != 0 && blocks_run >= opt_max_blocks){
+            console_flush();
+            printf("guest ran past --max-blocks %llu in --batch\n", (unsigned long long)opt_max_blocks);
+            code = -1;
+            break;
+        }
+        if(rt == VPX_RUN_BUDGET){continue;}
+
+        //[[ HOSTCALLS ]]
+        for(uint32_t l = 0; l < VPX_BATCH_LANES && code >= 0; l++){
+            if(b->state[l] == VPX_LANE_ERROR){
+                console_flush();
+                printf("error during vpx execution (clone %u).\n", index[l]);
+                printf("error code: %hhu\n", b->lane[l].err_code);
+                printf("error value: %u\n", b->lane[l].err_val);
+                printf("RPC state: %u\n", b->lane[l].err_pc_state);
+                code = -1; //An error stops everything, like with --many.
+                break;
+            }
+            if(b->state[l] != VPX_LANE_HOSTCALL){continue;}
+            vpx2_batch_get(b, l, &st);
+            vpx2_state_load(&st);
+            uint32_t hostcall_code = vpx2_rreg(61);
+            uint8_t hs = execute_hostcall(hostcall_code);
+            if(hs == HOSTCALL_PENDING){
+                pending_block(&hostcall_pending);
+                hs = HOSTCALL_OK;
+            }
+            if(hs == HOSTCALL_INVALID){
+                console_flush();
+                printf("attempt to execute invalid hostcall: %u", hostcall_code);
+                code = -1;
+                break;
+            }
+            vpx2_state_save(&st);
+            if(hs == HOSTCALL_EXIT){
+                code = guest_exit_code;
+                clone_destroy(&st);
+                b->state[l] = VPX_LANE_IDLE;
+                alive--;
+                continue;
+            }
+            vpx2_batch_set(b, l, &st);
+            b->state[l] = VPX_LANE_RUN;
+        }
+        if(code < 0){break;}
+    }
+    for(uint32_t l = 0; l < VPX_BATCH_LANES; l++){
+        if(b->state[l] != VPX_LANE_IDLE){
+            clone_destroy(&b->lane[l]);
+        }
+    }
+    template_destroy(&tpl);
+    free(b);
+    return code;
+    #else
+    (void)count;
+    printf("--batch needs a linux build with VPX_BATCH\n");
+    return -1;
+    #endif
+}
+
+int32_t run_interleave(uint32_t count){
+    //Runs count clones of the current VM VPX_INTERLEAVE_WAYS at a time on this thread, see
+    //[[ INTERLEAVE ]]. When a clone exits the next one takes its way. A hostcall is done as
+    //soon as its clone stops on it, a pending one blocks. Returns the exit code of the last
+    //clone to finish.
+    #if defined(VPX_INTERLEAVE) && defined(__linux__)
+    vpx_template tpl;
+    if(template_create(&tpl) != 0){
+        printf("failed to create clone template\n");
+        return -1;
+    }
+    vpx2_interleave* il = malloc(sizeof(vpx2_interleave));
+    if(il == NULL){
+        printf("failed to allocate interleave\n");
+        template_destroy(&tpl);
+        return -1;
+    }
+    vpx2_interleave_init(il);
+    uint32_t index[VPX_INTERLEAVE_WAYS]; //Clone in each way
+    uint32_t next = 0;
+    uint32_t alive = 0;
+    int32_t code = 0;
+    while(next < count || alive > 0){
+        for(uint32_t w = 0; w < VPX_INTERLEAVE_WAYS && next < count; w++){
+            if(il->state[w] != VPX_LANE_IDLE){continue;}
+            if(clone_create(&tpl, &il->vm[w]) != 0){
+                printf("failed to create clone %u\n", next);
+                code = -1;
+                break;
+            }
+            il->vm[w].registers[60] = next; //Hostcall 2 returns the clone's index.
+            il->state[w] = VPX_LANE_RUN;
+            index[w] = next++;
+            alive++;
+        }
+        if(code < 0){break;}
+
+        uint8_t rt = vpx2_interleave_run(il, opt_slice);
+        blocks_run += opt_slice - vpx2_budget;
+        if(rt == VPX_RUN_INTERRUPTED){
+            console_flush();
+            printf("guest interrupted (--timeout) in --interleave\n");
+            code = -1;
+            break;
+        }
+        if(opt_max_blocks != 0 && blocks_run >= opt_max_blocks){
+            console_flush();
+            printf("guest ran past --max-blocks %llu in --interleave\n", (unsigned long long)opt_max_blocks);
+            code = -1;
+            break;
+        }
+        if(rt == VPX_RUN_BUDGET){continue;}
+
+        for(uint32_t w = 0; w < VPX_INTERLEAVE_WAYS && code >= 0; w++){
+            if(il->state[w] == VPX_LANE_ERROR){
+                console_flush();
+                printf("error during vpx execution (clone %u).\n", index[w]);
+                printf("error code: %hhu\n", il->vm[w].err_code);
+                printf("error value: %u\n", il->vm[w].err_val);
+                printf("RPC state: %u\n", il->vm[w].err_pc_state);
+                code = -1; //An error stops everything, like with --many.
+                break;
+            }
+            if(il->state[w] != VPX_LANE_HOSTCALL){continue;}
+            vpx2_state_load(&il->vm[w]);
+            uint32_t hostcall_code = vpx2_rreg(61);
+            uint8_t hs = execute_hostcall(hostcall_code);
+            if(hs == HOSTCALL_PENDING){
+                pending_block(&hostcall_pending);
+                hs = HOSTCALL_OK;
+            }
+            if(hs == HOSTCALL_INVALID){
+                console_flush();
+                printf("attempt to execute invalid hostcall: %u", hostcall_code);
+                code = -1;
+                break;
+            }
+            vpx2_state_save(&il->vm[w]);
+            if(hs == HOSTCALL_EXIT){
+                code = guest_exit_code;
+                clone_destroy(&il->vm[w]);
+                il->state[w] = VPX_LANE_IDLE;
+                alive--;
+                continue;
+            }
+            il->state[w] = VPX_LANE_RUN;
+        }
+        if(code < 0){break;}
+    }
+    for(uint32_t w = 0; w < VPX_INTERLEAVE_WAYS; w++){
+        if(il->state[w] != VPX_LANE_IDLE){
+            clone_destroy(&il->vm[w]);
+        }
+    }
+    template_destroy(&tpl);
+    free(il);
+    return code;
+    #else
+    (void)count;
+    printf("--interleave needs a linux build with VPX_INTERLEAVE\n");
+    return -1;
+    #endif
+}
+
+
+uint8_t load_image(const char* path){
+    #ifndef _WIN32
+    //[[ PIPES ]]
+    //"-" is stdin. Anything that isn't a regular file can't be sized with fseek, it gets streamed.
+    if(strcmp(path, "-") == 0){
+        return stream_load(0);
+    }
+    #endif
+
+    FILE* file = fopen(path, "rb");
     //[[ CHECK IF FILE OPENED SUCCESSFULLY ]]
     if(file == NULL){
-        printf("failed to open file: %s \n", argv[1]);
+        printf("failed to open file: %s \n", path);
         return 1;
     }
 
+    #ifndef _WIN32
+    struct stat file_stat;
+    if(fstat(fileno(file), &file_stat) == 0 && !S_ISREG(file_stat.st_mode)){
+        return stream_load(fileno(file)); //Stays open, the reader keeps using it.
+    }
+    #endif
+
+    //[[ CONTAINER IMAGE ]]
+    char magic[4];
+    if(fread(magic, 1, 4, file) == 4 && memcmp(magic, VPX_IMG_MAGIC, 4) == 0){
+        uint8_t rt = image_load(file);
+        fclose(file);
+        return rt;
+    }
 
+    //[[ RAW IMAGE ]]
     uint32_t file_size = get_file_size(file);
 
-    uint8_t *mem_ptr = malloc(file_size);
+    #ifdef VPX_MASKED
+    //Masked mode needs a power of two memory size plus the tail pad, zeroed past the image.
+    uint32_t mem_size = vpx2_mem_pow2(file_size);
+    if(mem_size == 0){
+        printf("file too large for masked mode: %u Bytes\n", file_size);
+        return 1;
+    }
+    uint8_t *mem_ptr = image_alloc(vpx2_mem_bytes(mem_size));
+    #else
+    uint32_t mem_size = file_size;
+    uint8_t *mem_ptr = image_alloc(file_size); //Page aligned, file windows can be mapped over it.
+    #endif
 
     //[[ CHECK IF ALLOCATION SUCCESSFUL ]]
     if(mem_ptr == NULL){
@@ -49,33 +992,196 @@ int main(int argc, char *argv[]){
 
     //[[ COPY FILE CONTENTS TO ARRAY ]]
     fread(mem_ptr, 1, file_size, file);
+    fclose(file);
 
     //[[ INITIALIZE VPX ]]
-    vpx2_init(mem_ptr, file_size); //Can realloc with hostcalls if needed.
+    vpx2_init(mem_ptr, mem_size); //Can realloc with hostcalls if needed.
+    return 0;
+}
 
-    //[[ MAIN VPX LOOP ]]
-    while(1){
-        uint8_t rt = vpx2_start();
-        if(rt == 1){
-            printf("error during vpx execution.\n");
-            printf("error code: %hhu\n", vpx2_err_code);
-            printf("error value: %u\n", vpx2_err_val);
-            printf("RPC state: %u\n", vpx2_err_pc_state);
+
+uint8_t vm_prepare(){
+    //Per VM setup after loading, also done by every pipeline stage on its own thread.
+    #ifdef VPX_DIRTY
+    vpx2_dirty_map = calloc(1, VPX_DIRTY_PAGES(vpx2_mem_size));
+    if(vpx2_dirty_map == NULL){
+        printf("failed to allocate dirty page map\n");
+        return 1;
+    }
+    #endif
+
+    if(opt_timer != 0){
+        #ifdef VPX_TRAPS
+        vpx2_timer_period = vpx2_timer_left = opt_timer;
+        #else
+        printf("--timer needs a build with VPX_TRAPS\n");
+        return 1;
+        #endif
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    //Usage: vpx-run <file.vpx | -> [--mem <bytes>] [--snapshot <out.snap>] [--clones <n>] [--reuse <n>] [--many <n>] [--batch <n>] [--interleave <n>] [--slice <blocks>] [--max-blocks <n>] [--timeout <ms>] [--timer <blocks>] [--checkpoint <file.ckpt>] [--in <file>]... [--out <file>]... [--root <dir>] [--async-pool] [--stage <file.vpx>]... [--pipe-buf <bytes>] [--pipe-depth <n>] [--udf <in.rec> <out.rec>] [--udf-entry <pc>] [--udf-threads <n>]
+    //       vpx-run --pack <raw.vpx> <out.vpx>
+    //       vpx-run --pack-lz <raw.vpx> <out.vpx>
+    //       vpx-run --restore-checkpoint <file.ckpt> [--checkpoint <file.ckpt>]
+    //       vpx-run --restore <file.snap>
+    atexit(console_flush); //Also covers the exit() calls in hostcalls.
+    const char* image_path = NULL;
+    const char* restore_path = NULL;
+    const char* restore_ckpt_path = NULL;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc){
+            opt_snapshot_path = argv[++i];
+        }else if(strcmp(argv[i], "--restore") == 0 && i + 1 < argc){
+            restore_path = argv[++i];
+        }else if(strcmp(argv[i], "--clones") == 0 && i + 1 < argc){
+            opt_clones = strtoul(argv[++i], NULL, 10);
+        }else if(strcmp(argv[i], "--reuse") == 0 && i + 1 < argc){
+            opt_reuse = strtoul(argv[++i], NULL, 10);
+        }else if(strcmp(argv[i], "--many") == 0 && i + 1 < argc){
+            opt_many = strtoul(argv[++i], NULL, 10);
+        }else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc){
+            opt_batch = strtoul(argv[++i], NULL, 10);
+        }else if(strcmp(argv[i], "--interleave") == 0 && i + 1 < argc){
+            opt_interleave = strtoul(argv[++i], NULL, 10);
+        }else if(strcmp(argv[i], "--slice") == 0 && i + 1 < argc){
+            opt_slice = strtoul(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "--timeout") == 0 && i + 1 < argc){
+            opt_timeout_ms = strtoul(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "--timer") == 0 && i + 1 < argc){
+            opt_timer = strtoul(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "--max-blocks") == 0 && i + 1 < argc){
+            opt_max_blocks = strtoull(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "--mem") == 0 && i + 1 < argc){
+            #ifndef _WIN32
+            stream_mem = strtoul(argv[++i], NULL, 0); //Memory for raw images read from a pipe.
+            #else
+            i++;
+            #endif
+        }else if((strcmp(argv[i], "--in") == 0 || strcmp(argv[i], "--out") == 0) && i + 1 < argc){
+            //Files the guest can map with hostcalls 3 and 4, numbered in order per kind.
+            if(files_add(argv[i + 1], argv[i][2] == 'o') != 0){
+                printf("too many files: %s\n", argv[i + 1]);
+                return 1;
+            }
+            i++;
+        }else if(strcmp(argv[i], "--root") == 0 && i + 1 < argc){
+            io_root_path = argv[++i]; //Directory the guest can open files in.
+        }else if(strcmp(argv[i], "--async-pool") == 0){
+            async_use_pool = 1; //Async hostcalls on threads even where io_uring works.
+        }else if(strcmp(argv[i], "--stage") == 0 && i + 1 < argc){
+            if(pipe_stage_count == VPX_PIPE_STAGES - 1){
+                printf("too many pipeline stages\n");
+                return 1;
+            }
+            pipe_stage_paths[pipe_stage_count++] = argv[++i]; //Runs after the main image, fed by it.
+        }else if(strcmp(argv[i], "--pipe-buf") == 0 && i + 1 < argc){
+            opt_pipe_buf = strtoul(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "--pipe-depth") == 0 && i + 1 < argc){
+            opt_pipe_depth = strtoul(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "--udf") == 0 && i + 2 < argc){
+            opt_udf_in = argv[++i];
+            opt_udf_out = argv[++i];
+        }else if(strcmp(argv[i], "--udf-entry") == 0 && i + 1 < argc){
+            opt_udf_entry = strtoul(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "--udf-threads") == 0 && i + 1 < argc){
+            opt_udf_threads = strtoul(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc){
+            opt_checkpoint_path = argv[++i];
+        }else if(strcmp(argv[i], "--pack") == 0 && i + 2 < argc){
+            return image_pack(argv[i + 1], argv[i + 2], 0);
+        }else if(strcmp(argv[i], "--pack-lz") == 0 && i + 2 < argc){
+            return image_pack(argv[i + 1], argv[i + 2], 1);
+        }else if(strcmp(argv[i], "--restore-checkpoint") == 0 && i + 1 < argc){
+            restore_ckpt_path = argv[++i];
+        }else{
+            image_path = argv[i]; //First plain argument is the file.
+        }
+    }
+
+    if(restore_ckpt_path != NULL){
+        #ifdef VPX_CHECKPOINTS
+        if(checkpoint_restore(restore_ckpt_path) == NULL){
+            printf("failed to restore checkpoint: %s\n", restore_ckpt_path);
             return 1;
         }
-        uint32_t hostcall_code = vpx2_rreg(61);
-        uint8_t st = execute_hostcall(hostcall_code);
-        if(st == 1){
-            printf("attempt to execute invalid hostcall: %u", hostcall_code);
+        #else
+        printf("--restore-checkpoint needs a build with VPX_DIRTY\n");
+        return 1;
+        #endif
+    }else if(restore_path != NULL){
+        if(snapshot_restore(restore_path) == NULL){
+            printf("failed to restore snapshot: %s\n", restore_path);
+            return 1;
+        }
+    }else{
+        if(image_path == NULL){
+            printf("usage: vpx-run <file.vpx | -> [--mem <bytes>] [--snapshot <out.snap>] [--clones <n>] [--reuse <n>] [--many <n>] [--batch <n>] [--interleave <n>] [--slice <blocks>] [--max-blocks <n>] [--timeout <ms>] [--timer <blocks>] [--checkpoint <file.ckpt>] [--in <file>]... [--out <file>]... [--root <dir>] [--async-pool] [--stage <file.vpx>]... [--pipe-buf <bytes>] [--pipe-depth <n>] [--udf <in.rec> <out.rec>] [--udf-entry <pc>] [--udf-threads <n>] | --restore <file.snap> | --restore-checkpoint <file.ckpt> | --pack[-lz] <raw.vpx> <out.vpx>\n");
+            return 1;
+        }
+        if(load_image(image_path) != 0){
             return 1;
         }
-
-
     }
 
+    if(vm_prepare() != 0){
+        return 1;
+    }
 
+    if(opt_checkpoint_path != NULL){
+        #ifdef VPX_CHECKPOINTS
+        if(checkpoint_open(opt_checkpoint_path) != 0){
+            printf("failed to open checkpoint file: %s\n", opt_checkpoint_path);
+            return 1;
+        }
+        #else
+        printf("--checkpoint needs a build with VPX_DIRTY\n");
+        return 1;
+        #endif
+    }
 
-    return 0;
+    if(opt_timeout_ms != 0){
+        #ifndef _WIN32
+        pthread_t watchdog_thread;
+        if(pthread_create(&watchdog_thread, NULL, watchdog, NULL) != 0){
+            printf("failed to start watchdog\n");
+            return 1;
+        }
+        pthread_detach(watchdog_thread);
+        #else
+        printf("--timeout is not supported on windows\n");
+        return 1;
+        #endif
+    }
 
-    
+    harts_enabled = opt_snapshot_path == NULL && opt_clones == 0 && opt_reuse == 0 && opt_many == 0 && opt_batch == 0 && opt_interleave == 0 && opt_checkpoint_path == NULL;
+    if(pipe_stage_count != 0 && !harts_enabled){
+        printf("--stage can't be combined with --snapshot, --clones, --reuse, --many, --batch, --interleave or --checkpoint\n");
+        return 1;
+    }
+    if(opt_udf_in != NULL && (!harts_enabled || pipe_stage_count != 0)){
+        printf("--udf can't be combined with --snapshot, --clones, --reuse, --many, --batch, --interleave, --checkpoint or --stage\n");
+        return 1;
+    }
+    int32_t code = pipe_stage_count != 0 ? pipe_run() : run_vm();
+    if(opt_udf_in != NULL && code >= 0){
+        if(!udf_ready){
+            printf("guest exited before hostcall 36, no --udf warm point\n");
+            code = -1;
+        }else{
+            code = udf_run();
+        }
+    }
+    files_close();
+    #ifdef VPX_CHECKPOINTS
+    if(opt_checkpoint_path != NULL && checkpoint_close() != 0){
+        code = -1; //The writer already said so, the file ends at the last good checkpoint.
+    }
+    #endif
+    if(code < 0){
+        return 1;
+    }
+    return code;
 }
\ No newline at end of file
@@ -27,8 +27,154 @@
 #define VPX_ERR_RREG_64 13
 #define VPX_ERR_WREG_64 14
 
+#define VPX_ERR_ATOMIC_ALIGN 15 //Atomic access to an address that isn't 4B aligned.
+#define VPX_ERR_CONTEXT 16 //swctx to a context the table doesn't have, or a table outside memory.
+
 #define VPX_ERR_INVALID_OPCODE 255
 
+//== harts ==
+#ifdef VPX_HARTS
+//Several harts (hardware threads) run over the same guest memory, each on its own host thread.
+//Everything a hart owns (registers, error state, run budget, traps) is thread local, and so
+//is which memory it runs on: harts of one VM point at the same memory, while threads
+//running separate VMs (pipeline stages) each have their own. Plain loads and stores between
+//harts are unordered, guests synchronize with the atomic extension, which harts always have.
+#define VPX_HART_LOCAL _Thread_local
+#ifndef VPX_ISA_ATOMIC
+#define VPX_ISA_ATOMIC
+#endif
+#else
+#define VPX_HART_LOCAL
+#endif
+
+//== cpu id bits ==
+//Low byte is the version, the rest says which ISA extensions are compiled in.
+#define VPX_CPUID_GAMMA 0b1
+#define VPX_CPUID_ISA_64 (1u << 8)
+#define VPX_CPUID_ISA_FPU (1u << 9)
+#define VPX_CPUID_ISA_FPU_64 (1u << 10)
+#define VPX_CPUID_ISA_ATOMIC (1u << 11)
+#define VPX_CPUID_ISA_CONTEXTS (1u << 12)
+
+#ifdef VPX_ISA_64
+#define VPX_CPUID_64_BIT VPX_CPUID_ISA_64
+#else
+#define VPX_CPUID_64_BIT 0
+#endif
+#ifdef VPX_ISA_FPU
+#define VPX_CPUID_FPU_BIT VPX_CPUID_ISA_FPU
+#else
+#define VPX_CPUID_FPU_BIT 0
+#endif
+#ifdef VPX_ISA_FPU_64
+#define VPX_CPUID_FPU_64_BIT VPX_CPUID_ISA_FPU_64
+#else
+#define VPX_CPUID_FPU_64_BIT 0
+#endif
+#ifdef VPX_ISA_ATOMIC
+#define VPX_CPUID_ATOMIC_BIT VPX_CPUID_ISA_ATOMIC
+#else
+#define VPX_CPUID_ATOMIC_BIT 0
+#endif
+#ifdef VPX_ISA_CONTEXTS
+#define VPX_CPUID_CONTEXTS_BIT VPX_CPUID_ISA_CONTEXTS
+#else
+#define VPX_CPUID_CONTEXTS_BIT 0
+#endif
+
+//== masked memory mode ==
+#ifdef VPX_MASKED
+//Memory size is a power of two and every address is ANDed with vpx2_mem_mask.
+//The host must allocate mem_size + VPX_MASK_PAD bytes so multi-byte
+//accesses starting near the top of memory stay inside the buffer.
+//A 32 bit access at the last address reaches 3 bytes past it.
+#define VPX_MASK_PAD 3
+#else
+#define VPX_MASK_PAD 0
+#endif
+
+//== run status ==
+//vpx2_run results, vpx2_start never returns VPX_RUN_BUDGET.
+#define VPX_RUN_HOSTCALL 0
+#define VPX_RUN_ERROR 1
+#define VPX_RUN_BUDGET 2 //Budget used up, state is intact, vpx2_run again to resume.
+#define VPX_RUN_INTERRUPTED 3 //vpx2_interrupt was called, stopped at vpx2_err_pc_state, resumable.
+#define VPX_RUN_RETURNED 4 //The function vpx2_call started returned.
+
+//== calls ==
+#define VPX_CALL_RETURN 0xFFFFFFFFu //Return address vpx2_call pushes, a ret to it goes back to the host.
+#define VPX_CALL_ARGS 8 //r0 - r7, arguments in and results out.
+
+//== traps ==
+#ifdef VPX_TRAPS
+//Guest interrupt vector table: VPX_TRAP_VECTORS u32 handler addresses at vpx2_ivt, indexed by
+//VPX_ERR_* code, vector 0 is the timer. With vpx2_ivt at 0 or a 0 entry the fault stops the VM as usual.
+//Entering a handler pushes the PC of the faulting instruction (for the timer the next one to run),
+//then vpx2_err_val (0 for the timer). The handler pops the value and ends with ret, a fault
+//handler has to fix the cause or change the return PC or it faults again.
+//The timer fires every vpx2_timer_period blocks (0 is off), counted with the vpx2_run budget,
+//so it costs nothing per block. Handlers aren't masked, keep the period longer than the handler.
+#define VPX_TRAP_VECTORS 256
+#define VPX_TRAP_TIMER 0
+#endif
+
+//== register contexts ==
+#ifdef VPX_ISA_CONTEXTS
+//Green threads. The guest points ctxbase at a table of vpx2_ctx_count register files in its
+//own memory (VPX_CONTEXT_SIZE bytes each, little endian like all guest memory) and swctx
+//stores the live registers into the current slot and loads another one, no host exit.
+//The table is plain memory, the guest sets up a new context (RPC, RSP, arguments)
+//with ordinary stores before switching to it. Snapshots and checkpoints get it for free.
+#define VPX_CONTEXT_SIZE (64 * 4)
+#endif
+
+//== batch ==
+#ifdef VPX_BATCH
+//Lockstep lanes, see [[ BATCH ]]. 8 lanes of 32 bits fill one AVX2 register.
+#ifndef VPX_BATCH_LANES
+#define VPX_BATCH_LANES 8
+#endif
+#endif
+
+//== interleave ==
+#ifdef VPX_INTERLEAVE
+//VMs taking turns a block at a time on one thread, see [[ INTERLEAVE ]].
+#ifndef VPX_INTERLEAVE_WAYS
+#define VPX_INTERLEAVE_WAYS 8
+#endif
+#ifndef VPX_INTERLEAVE_SCAN
+#define VPX_INTERLEAVE_SCAN 16 //Instructions of the next block looked at for prefetches, 0 turns them off.
+#endif
+#endif
+
+#if defined(VPX_BATCH) || defined(VPX_INTERLEAVE)
+#define VPX_LANE_RUN 0
+#define VPX_LANE_HOSTCALL 1 //Stopped right after a hostcall opcode.
+#define VPX_LANE_ERROR 2 //lane[].err_* (vm[].err_*) says what happened.
+#define VPX_LANE_IDLE 3 //Nothing loaded, or the host took it out.
+#endif
+
+//== pages ==
+//Granularity of the dirty and ready maps below. VPX_MEM_PAGES also covers the masked mode tail pad.
+#define VPX_PAGE_SHIFT 12
+#define VPX_PAGE_SIZE (1u << VPX_PAGE_SHIFT)
+#define VPX_MEM_PAGES(mem_size) ((((uint64_t)(mem_size) + VPX_MASK_PAD + VPX_PAGE_SIZE - 1) >> VPX_PAGE_SHIFT))
+
+//== dirty page tracking ==
+#ifdef VPX_DIRTY
+//Every memory write marks its page in vpx2_dirty_map (one byte per page, set to 1).
+//The host allocates VPX_DIRTY_PAGES(mem_size) zeroed bytes and sets vpx2_dirty_map.
+#define VPX_DIRTY_PAGES(mem_size) VPX_MEM_PAGES(mem_size)
+#endif
+
+//== streamed memory ==
+#ifdef VPX_STREAM
+//Memory is still being filled in (image arriving over a pipe) while the VM runs.
+//vpx2_ready_map has one byte per page (VPX_MEM_PAGES), non-zero once the page's contents are final.
+//Any access to a page that isn't ready calls vpx2_stream_wait, which has to block until it is.
+//The host clears vpx2_streaming once the whole image is in, after that no page is checked.
+#endif
+
 //this is essentially for formatting, if the system is little endian it does nothing
 //otherwise it swaps
 #ifdef VPX_BIG_ENDIAN
@@ -53,16 +199,41 @@ static inline uint32_t vpx2_16b_endian_fmt(uint16_t val){
 #ifndef VPX_DEFINED
 
 //[[ SYSTEM ]]
-uint32_t vpx2_cpu_id = 0b1; //Gamma version
+uint32_t vpx2_cpu_id = VPX_CPUID_GAMMA | VPX_CPUID_64_BIT | VPX_CPUID_FPU_BIT | VPX_CPUID_FPU_64_BIT | VPX_CPUID_ATOMIC_BIT | VPX_CPUID_CONTEXTS_BIT; //Gamma version + extensions
 //[[ ERROR ]]
-uint8_t vpx2_err_code = 0;
-uint32_t vpx2_err_val = 0;
-uint32_t vpx2_err_pc_state = 0;
+VPX_HART_LOCAL uint8_t vpx2_err_code = 0;
+VPX_HART_LOCAL uint32_t vpx2_err_val = 0;
+VPX_HART_LOCAL uint32_t vpx2_err_pc_state = 0;
+//[[ RUN ]]
+VPX_HART_LOCAL uint32_t vpx2_budget = 0; //Blocks vpx2_run may still finish.
+uint8_t vpx2_interrupted = 0; //Set from any thread by vpx2_interrupt.
+VPX_HART_LOCAL uint32_t vpx2_call_depth = 0; //vpx2_calls running, only then is a ret to VPX_CALL_RETURN special.
+#ifdef VPX_ISA_CONTEXTS
+VPX_HART_LOCAL uint32_t vpx2_ctx_base = 0; //Guest address of the context table
+VPX_HART_LOCAL uint32_t vpx2_ctx_count = 0; //Contexts in it, 0 is no table.
+VPX_HART_LOCAL uint32_t vpx2_ctx_current = 0; //Slot the live registers belong to.
+#endif
+#ifdef VPX_TRAPS
+VPX_HART_LOCAL uint32_t vpx2_ivt = 0; //Guest address of the vector table, 0 is off.
+VPX_HART_LOCAL uint32_t vpx2_timer_period = 0; //Blocks between timer traps, 0 is off.
+VPX_HART_LOCAL uint32_t vpx2_timer_left = 0; //Blocks until the next one.
+#endif
 
-uint8_t* vpx2_mem_ptr = VPXNULL;
-uint32_t vpx2_mem_size = 0;
+VPX_HART_LOCAL uint8_t* vpx2_mem_ptr = VPXNULL;
+VPX_HART_LOCAL uint32_t vpx2_mem_size = 0;
+#ifdef VPX_MASKED
+VPX_HART_LOCAL uint32_t vpx2_mem_mask = 0;
+#endif
+#ifdef VPX_DIRTY
+VPX_HART_LOCAL uint8_t* vpx2_dirty_map = VPXNULL;
+#endif
+#ifdef VPX_STREAM
+uint8_t* vpx2_ready_map = VPXNULL;
+uint8_t vpx2_streaming = 0;
+void (*vpx2_stream_wait)(uint32_t adr, uint32_t len) = VPXNULL;
+#endif
 
-uint32_t vpx2_registers[64] = {
+VPX_HART_LOCAL uint32_t vpx2_registers[64] = {
     0,
     //r62 = RPC
     //r63 = RSP
@@ -74,15 +245,40 @@ uint32_t vpx2_registers[64] = {
 #else
 extern uint32_t vpx2_cpu_id;
 
-extern uint8_t vpx2_err_code;
-extern uint32_t vpx2_err_val;
-extern uint32_t vpx2_err_pc_state;
+extern VPX_HART_LOCAL uint8_t vpx2_err_code;
+extern VPX_HART_LOCAL uint32_t vpx2_err_val;
+extern VPX_HART_LOCAL uint32_t vpx2_err_pc_state;
+
+extern VPX_HART_LOCAL uint32_t vpx2_budget;
+extern uint8_t vpx2_interrupted;
+extern VPX_HART_LOCAL uint32_t vpx2_call_depth;
+#ifdef VPX_ISA_CONTEXTS
+extern VPX_HART_LOCAL uint32_t vpx2_ctx_base;
+extern VPX_HART_LOCAL uint32_t vpx2_ctx_count;
+extern VPX_HART_LOCAL uint32_t vpx2_ctx_current;
+#endif
+#ifdef VPX_TRAPS
+extern VPX_HART_LOCAL uint32_t vpx2_ivt;
+extern VPX_HART_LOCAL uint32_t vpx2_timer_period;
+extern VPX_HART_LOCAL uint32_t vpx2_timer_left;
+#endif
 
 //[[ MEMORY VARIABLES ]]
 
-extern uint8_t* vpx2_mem_ptr;
-extern uint32_t vpx2_mem_size;
-extern uint32_t vpx2_registers[64];
+extern VPX_HART_LOCAL uint8_t* vpx2_mem_ptr;
+extern VPX_HART_LOCAL uint32_t vpx2_mem_size;
+#ifdef VPX_MASKED
+extern VPX_HART_LOCAL uint32_t vpx2_mem_mask;
+#endif
+#ifdef VPX_DIRTY
+extern VPX_HART_LOCAL uint8_t* vpx2_dirty_map;
+#endif
+#ifdef VPX_STREAM
+extern uint8_t* vpx2_ready_map;
+extern uint8_t vpx2_streaming;
+extern void (*vpx2_stream_wait)(uint32_t adr, uint32_t len);
+#endif
+extern VPX_HART_LOCAL uint32_t vpx2_registers[64];
 
 
 
@@ -101,7 +297,16 @@ static inline void vpx2_log_err(uint8_t code, uint32_t value){
 
 //[[ CPU REGISTER FUNCTIONS ]]
 
-#ifdef VPX_SAFE
+#if defined(VPX_MASKED)
+//Register index is masked too, so a bad operand can't index past the register file.
+static inline uint32_t vpx2_rreg(uint8_t reg){
+    return vpx2_registers[reg & 63];
+}
+static inline void vpx2_wreg(uint8_t reg, uint32_t val){
+    vpx2_registers[reg & 63] = val;
+}
+
+#elif defined(VPX_SAFE)
 static inline uint32_t vpx2_rreg(uint8_t reg){
     //You may remove this check if you provide a different
     //register stack without using unsafe mode
@@ -135,12 +340,91 @@ static inline void vpx2_wreg(uint8_t reg, uint32_t val){
 
 //[[ MEMORY FUNCTIONS ]]
 
-#ifdef VPX_SAFE
+#ifdef VPX_DIRTY
+//Marks the first and last page of a write. A write never spans more than 2 pages.
+//Plain stores, no test, so the write path stays branch-free.
+static inline void vpx2_mem_mark(uint32_t adr, uint32_t len){
+    vpx2_dirty_map[adr >> VPX_PAGE_SHIFT] = 1;
+    vpx2_dirty_map[(adr + len - 1) >> VPX_PAGE_SHIFT] = 1;
+}
+#else
+static inline void vpx2_mem_mark(uint32_t adr, uint32_t len){
+    //Optimized away when tracking is off.
+    (void)adr; (void)len;
+}
+#endif
+
+#ifdef VPX_STREAM
+//Stalls until the pages of an access have arrived. Kept out of line, calls in the
+//memory helpers stop GCC from inlining them into vpx2_exec.
+__attribute__((noinline, cold)) static void vpx2_mem_stall(uint32_t adr, uint32_t len){
+    uint8_t first = __atomic_load_n(&vpx2_ready_map[adr >> VPX_PAGE_SHIFT], __ATOMIC_ACQUIRE);
+    uint8_t last = __atomic_load_n(&vpx2_ready_map[(adr + len - 1) >> VPX_PAGE_SHIFT], __ATOMIC_ACQUIRE);
+    if(!(first && last)){
+        vpx2_stream_wait(adr, len);
+    }
+}
+
+static inline void vpx2_mem_need(uint32_t adr, uint32_t len){
+    //One load and a well predicted branch once the image is fully loaded.
+    if(__builtin_expect(__atomic_load_n(&vpx2_streaming, __ATOMIC_ACQUIRE), 0)){
+        vpx2_mem_stall(adr, len);
+    }
+}
+#else
+static inline void vpx2_mem_need(uint32_t adr, uint32_t len){
+    //Optimized away when memory isn't streamed.
+    (void)adr; (void)len;
+}
+#endif
+
+#if defined(VPX_MASKED)
+//Branch-free sandbox. Out of range addresses wrap around inside guest memory
+//instead of being reported, the tail pad absorbs the last 1-3 bytes of
+//multi-byte accesses at the top of memory.
+static inline uint8_t vpx2_mem_r8(uint32_t adr){
+    vpx2_mem_need(adr & vpx2_mem_mask, 1);
+    return vpx2_mem_ptr[adr & vpx2_mem_mask];
+}
+static inline uint16_t vpx2_mem_r16(uint32_t adr){
+    uint16_t ds;
+    vpx2_mem_need(adr & vpx2_mem_mask, 2);
+    memcpy(&ds, &vpx2_mem_ptr[adr & vpx2_mem_mask], 2);
+    return vpx2_16b_endian_fmt(ds);
+}
+
+static inline uint32_t vpx2_mem_r32(uint32_t adr){
+    uint32_t ds;
+    vpx2_mem_need(adr & vpx2_mem_mask, 4);
+    memcpy(&ds, &vpx2_mem_ptr[adr & vpx2_mem_mask], 4);
+    return vpx2_32b_endian_fmt(ds);
+}
+
+static inline void vpx2_mem_w8(uint32_t adr, uint8_t val){
+    vpx2_mem_need(adr & vpx2_mem_mask, 1);
+    vpx2_mem_mark(adr & vpx2_mem_mask, 1);
+    vpx2_mem_ptr[adr & vpx2_mem_mask] = val;
+}
+static inline void vpx2_mem_w16(uint32_t adr, uint16_t val){
+    uint16_t tmp = vpx2_16b_endian_fmt(val);
+    vpx2_mem_need(adr & vpx2_mem_mask, 2);
+    vpx2_mem_mark(adr & vpx2_mem_mask, 2);
+    memcpy(&vpx2_mem_ptr[adr & vpx2_mem_mask], &tmp, 2);
+}
+static inline void vpx2_mem_w32(uint32_t adr, uint32_t val){
+    uint32_t tmp = vpx2_32b_endian_fmt(val);
+    vpx2_mem_need(adr & vpx2_mem_mask, 4);
+    vpx2_mem_mark(adr & vpx2_mem_mask, 4);
+    memcpy(&vpx2_mem_ptr[adr & vpx2_mem_mask], &tmp, 4);
+}
+
+#elif defined(VPX_SAFE)
 static inline uint8_t vpx2_mem_r8(uint32_t adr){
     if(adr >= vpx2_mem_size){
         vpx2_log_err(3, adr); //log code and value
         return 0;
     }
+    vpx2_mem_need(adr, 1);
     return vpx2_mem_ptr[adr];
 }
 static inline uint16_t vpx2_mem_r16(uint32_t adr){
@@ -149,6 +433,7 @@ static inline uint16_t vpx2_mem_r16(uint32_t adr){
         return 0;
     }
     uint16_t ds;
+    vpx2_mem_need(adr, 2);
     memcpy(&ds, &vpx2_mem_ptr[adr], 2);
     return vpx2_16b_endian_fmt(ds);
 }
@@ -159,6 +444,7 @@ static inline uint32_t vpx2_mem_r32(uint32_t adr){
         return 0;
     }
     uint32_t ds;
+    vpx2_mem_need(adr, 4);
     memcpy(&ds, &vpx2_mem_ptr[adr], 4);
     return vpx2_32b_endian_fmt(ds);
 }
@@ -168,6 +454,8 @@ static inline void vpx2_mem_w8(uint32_t adr, uint8_t val){
         vpx2_log_err(6, adr); //log code and value
         return;
     }
+    vpx2_mem_need(adr, 1);
+    vpx2_mem_mark(adr, 1);
     vpx2_mem_ptr[adr] = val;
 }
 static inline void vpx2_mem_w16(uint32_t adr, uint16_t val){
@@ -176,6 +464,8 @@ static inline void vpx2_mem_w16(uint32_t adr, uint16_t val){
         return;
     }
     uint16_t tmp = vpx2_16b_endian_fmt(val);
+    vpx2_mem_need(adr, 2);
+    vpx2_mem_mark(adr, 2);
     memcpy(&vpx2_mem_ptr[adr], &tmp, 2);
 }
 static inline void vpx2_mem_w32(uint32_t adr, uint32_t val){
@@ -184,36 +474,47 @@ static inline void vpx2_mem_w32(uint32_t adr, uint32_t val){
         return;
     }
     uint32_t tmp = vpx2_32b_endian_fmt(val);
+    vpx2_mem_need(adr, 4);
+    vpx2_mem_mark(adr, 4);
     memcpy(&vpx2_mem_ptr[adr], &tmp, 4);
 }
 
 #else
 
 static inline uint8_t vpx2_mem_r8(uint32_t adr){
+    vpx2_mem_need(adr, 1);
     return vpx2_mem_ptr[adr];
 }
 static inline uint16_t vpx2_mem_r16(uint32_t adr){
     uint16_t ds;
+    vpx2_mem_need(adr, 2);
     memcpy(&ds, &vpx2_mem_ptr[adr], 2);
     return vpx2_16b_endian_fmt(ds);
 }
 
 static inline uint32_t vpx2_mem_r32(uint32_t adr){
     uint32_t ds;
+    vpx2_mem_need(adr, 4);
     memcpy(&ds, &vpx2_mem_ptr[adr], 4);
     return vpx2_32b_endian_fmt(ds);
 }
 
 
 static inline void vpx2_mem_w8(uint32_t adr, uint8_t val){
+    vpx2_mem_need(adr, 1);
+    vpx2_mem_mark(adr, 1);
     vpx2_mem_ptr[adr] = val;
 }
 static inline void vpx2_mem_w16(uint32_t adr, uint16_t val){
     uint16_t tmp = vpx2_16b_endian_fmt(val);
+    vpx2_mem_need(adr, 2);
+    vpx2_mem_mark(adr, 2);
     memcpy(&vpx2_mem_ptr[adr], &tmp, 2);
 }
 static inline void vpx2_mem_w32(uint32_t adr, uint32_t val){
     uint32_t tmp = vpx2_32b_endian_fmt(val);
+    vpx2_mem_need(adr, 4);
+    vpx2_mem_mark(adr, 4);
     memcpy(&vpx2_mem_ptr[adr], &tmp, 4);
 }
 
@@ -224,6 +525,29 @@ static inline void vpx2_mem_w32(uint32_t adr, uint32_t val){
 
 #endif
 
+//== host access ==
+static inline uint8_t* vpx2_mem_host(uint32_t adr, uint32_t len, uint8_t write){
+    //Host pointer to guest memory [adr, adr + len) for hostcalls that do bulk I/O straight
+    //into guest memory. One bounds check, VPXNULL if the range doesn't fit.
+    //Waits for streamed pages and, if write is set, marks every page dirty.
+    if((uint64_t)adr + len > vpx2_mem_size){
+        return VPXNULL;
+    }
+    #if defined(VPX_DIRTY) || defined(VPX_STREAM)
+    if(len != 0){
+        for(uint32_t page = adr >> VPX_PAGE_SHIFT; page <= (adr + len - 1) >> VPX_PAGE_SHIFT; page++){
+            vpx2_mem_need(page << VPX_PAGE_SHIFT, 1);
+            if(write){
+                vpx2_mem_mark(page << VPX_PAGE_SHIFT, 1);
+            }
+        }
+    }
+    #else
+    (void)write;
+    #endif
+    return vpx2_mem_ptr + adr;
+}
+
 //[[ CONCIDERING THEY USE WRITE AND READ FUNCTIONS, IT IS NOT REQUIRED TO MAKE SEPERATE SAFE AND UNSAFE VARIANTS ]]
 static inline void vpx2_mem_pu8(uint8_t val){
     //Push 8 bit
@@ -1595,6 +1919,178 @@ static inline void vpx2_wreg_64(uint8_t reg, uint64_t val){
 
 
 
+//[[ ATOMIC EXTENSION ]]
+#ifdef VPX_ISA_ATOMIC
+//4B atomics on guest memory, all sequentially consistent. Addresses are absolute
+//(taken from r2) and must be 4B aligned, masked mode rounds them down instead.
+static inline uint32_t* vpx2_mem_atomic(uint32_t adr, uint8_t write){
+    //Host pointer for an atomic access, VPXNULL (and an error logged) if it's unaligned or out of range.
+    #ifdef VPX_MASKED
+    adr &= vpx2_mem_mask & ~3u;
+    #else
+    if(adr % 4 != 0 || (uint64_t)adr + 4 > vpx2_mem_size){
+        vpx2_log_err(adr % 4 != 0 ? VPX_ERR_ATOMIC_ALIGN : (write ? VPX_ERR_MEM_W32 : VPX_ERR_MEM_R32), adr);
+        return VPXNULL;
+    }
+    #endif
+    vpx2_mem_need(adr, 4);
+    if(write){
+        vpx2_mem_mark(adr, 4);
+    }
+    return (uint32_t*)(vpx2_mem_ptr + adr);
+}
+
+static inline void vpx2_isa_ald32(){
+    //===========================================
+    //Atomically load 4B to r1 from address r2
+    //===========================================
+    //C syntax: registers[r1] = atomic_load(&mem[registers[r2]]);
+    //Pseudocode: r1 <- mem[r2] (atomic)
+    //===========================================
+    uint8_t r1 = vpx2_mem_f8();
+    uint8_t r2 = vpx2_mem_f8();
+
+    uint32_t* ptr = vpx2_mem_atomic(vpx2_rreg(r2), 0);
+    if(ptr == VPXNULL){return;}
+    vpx2_wreg(r1, vpx2_32b_endian_fmt(__atomic_load_n(ptr, __ATOMIC_SEQ_CST)));
+}
+
+static inline void vpx2_isa_ast32(){
+    //===========================================
+    //Atomically store 4B from r1 to address r2
+    //===========================================
+    //C syntax: atomic_store(&mem[registers[r2]], registers[r1]);
+    //Pseudocode: mem[r2] <- r1 (atomic)
+    //===========================================
+    uint8_t r1 = vpx2_mem_f8();
+    uint8_t r2 = vpx2_mem_f8();
+
+    uint32_t val1 = vpx2_rreg(r1);
+    uint32_t* ptr = vpx2_mem_atomic(vpx2_rreg(r2), 1);
+    if(ptr == VPXNULL){return;}
+    __atomic_store_n(ptr, vpx2_32b_endian_fmt(val1), __ATOMIC_SEQ_CST);
+}
+
+static inline void vpx2_isa_acas(){
+    //===========================================
+    //Compare and swap: if mem[r2] equals r1 it becomes r3.
+    //r1 gets the old value either way, it succeeded if r1 didn't change.
+    //===========================================
+    //C syntax: old = mem[registers[r2]]; if(old == registers[r1]){mem[registers[r2]] = registers[r3];} registers[r1] = old;
+    //Pseudocode: r1 <- cas(mem[r2], r1, r3)
+    //===========================================
+    uint8_t r1 = vpx2_mem_f8();
+    uint8_t r2 = vpx2_mem_f8();
+    uint8_t r3 = vpx2_mem_f8();
+
+    uint32_t expected = vpx2_32b_endian_fmt(vpx2_rreg(r1));
+    uint32_t val3 = vpx2_32b_endian_fmt(vpx2_rreg(r3));
+    uint32_t* ptr = vpx2_mem_atomic(vpx2_rreg(r2), 1);
+    if(ptr == VPXNULL){return;}
+    __atomic_compare_exchange_n(ptr, &expected, val3, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    vpx2_wreg(r1, vpx2_32b_endian_fmt(expected)); //Holds the old value now.
+}
+
+static inline void vpx2_isa_aadd(){
+    //===========================================
+    //Atomically add r3 to mem[r2], r1 gets the old value
+    //===========================================
+    //C syntax: registers[r1] = atomic_fetch_add(&mem[registers[r2]], registers[r3]);
+    //Pseudocode: r1 <- mem[r2] : mem[r2] <- mem[r2] + r3 (atomic)
+    //===========================================
+    uint8_t r1 = vpx2_mem_f8();
+    uint8_t r2 = vpx2_mem_f8();
+    uint8_t r3 = vpx2_mem_f8();
+
+    uint32_t val3 = vpx2_rreg(r3);
+    uint32_t* ptr = vpx2_mem_atomic(vpx2_rreg(r2), 1);
+    if(ptr == VPXNULL){return;}
+    #ifdef VPX_BIG_ENDIAN
+    //Memory is little endian, the add can't be done in place.
+    uint32_t old = __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+    while(!__atomic_compare_exchange_n(ptr, &old, vpx2_32b_endian_fmt(vpx2_32b_endian_fmt(old) + val3), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){}
+    vpx2_wreg(r1, vpx2_32b_endian_fmt(old));
+    #else
+    vpx2_wreg(r1, __atomic_fetch_add(ptr, val3, __ATOMIC_SEQ_CST));
+    #endif
+}
+
+static inline void vpx2_isa_fence(){
+    //===========================================
+    //Full memory fence, plain loads and stores before it are
+    //visible to other harts before any after it.
+    //===========================================
+    //C syntax: atomic_thread_fence(seq_cst);
+    //Pseudocode: fence
+    //===========================================
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#endif
+
+//[[ CONTEXT EXTENSION ]]
+#ifdef VPX_ISA_CONTEXTS
+static inline void vpx2_isa_ctxbase(){
+    //===========================================
+    //Sets the context table to r2 slots at address r1,
+    //the running registers become slot 0. r2 = 0 removes the table.
+    //===========================================
+    //C syntax: ctx_base = registers[r1]; ctx_count = registers[r2]; ctx_current = 0;
+    //Pseudocode: ctx <- (r1, r2)
+    //===========================================
+    uint8_t r1 = vpx2_mem_f8();
+    uint8_t r2 = vpx2_mem_f8();
+
+    uint32_t val1 = vpx2_rreg(r1);
+    uint32_t val2 = vpx2_rreg(r2);
+    if((uint64_t)val1 + (uint64_t)val2 * VPX_CONTEXT_SIZE > vpx2_mem_size){
+        //Checked once here so swctx doesn't have to.
+        vpx2_log_err(VPX_ERR_CONTEXT, val1);
+        return;
+    }
+    vpx2_ctx_base = val1;
+    vpx2_ctx_count = val2;
+    vpx2_ctx_current = 0;
+}
+
+static inline void vpx2_isa_swctx(){
+    //===========================================
+    //Saves all registers to the current context slot and
+    //continues in slot r1. The saved RPC is the next instruction.
+    //===========================================
+    //C syntax: ctx[ctx_current] = registers; registers = ctx[registers[r1]]; ctx_current = registers[r1];
+    //Pseudocode: ctx[cur] <- regs : regs <- ctx[r1]
+    //===========================================
+    uint8_t r1 = vpx2_mem_f8();
+
+    uint32_t id = vpx2_rreg(r1);
+    if(id >= vpx2_ctx_count){
+        vpx2_log_err(VPX_ERR_CONTEXT, id);
+        return;
+    }
+    uint32_t save = vpx2_ctx_base + vpx2_ctx_current * VPX_CONTEXT_SIZE;
+    uint32_t load = vpx2_ctx_base + id * VPX_CONTEXT_SIZE;
+    vpx2_mem_need(save, VPX_CONTEXT_SIZE);
+    vpx2_mem_need(load, VPX_CONTEXT_SIZE);
+    vpx2_mem_mark(save, VPX_CONTEXT_SIZE);
+    #ifdef VPX_BIG_ENDIAN
+    for(uint32_t i = 0; i < 64; i++){
+        uint32_t tmp = vpx2_32b_endian_fmt(vpx2_registers[i]);
+        memcpy(vpx2_mem_ptr + save + i * 4, &tmp, 4);
+    }
+    for(uint32_t i = 0; i < 64; i++){
+        uint32_t tmp;
+        memcpy(&tmp, vpx2_mem_ptr + load + i * 4, 4);
+        vpx2_registers[i] = vpx2_32b_endian_fmt(tmp);
+    }
+    #else
+    //Two 256B copies, the whole switch.
+    memcpy(vpx2_mem_ptr + save, vpx2_registers, VPX_CONTEXT_SIZE);
+    memcpy(vpx2_registers, vpx2_mem_ptr + load, VPX_CONTEXT_SIZE);
+    #endif
+    vpx2_ctx_current = id;
+}
+#endif
+
 //[[ FPU EXTENSION ]]
 #ifdef VPX_ISA_FPU
 
@@ -1614,6 +2110,16 @@ static inline void vpx2_wreg_64(uint8_t reg, uint64_t val){
 
 //[[ ISA PRIMARY EXEC ]]
 
+static inline uint8_t vpx2_block_end(){
+    //Charges a finished block to the vpx2_run budget, exec returns this.
+    //2 when the budget is used up, 3 when interrupted.
+    #ifdef VPX_SAFE
+    if(vpx2_err_code){return 1;} //error!
+    #endif
+    if(__builtin_expect(__atomic_load_n(&vpx2_interrupted, __ATOMIC_RELAXED), 0)){return 3;}
+    return --vpx2_budget == 0 ? 2 : 0;
+}
+
 #ifdef VPX_SAFE
 static inline uint8_t vpx2_exec(){
     //Triggers error on invalid opcode.
@@ -1673,29 +2179,46 @@ static inline uint8_t vpx2_exec(){
         case 43: vpx2_isa_st8r(); break;
         case 44: vpx2_isa_st16r(); break;
         case 45: vpx2_isa_st32r(); break;
-        case 46: vpx2_isa_jmp(); break;
-        case 47: vpx2_isa_jmpr(); break;
-        case 48: vpx2_isa_jmps(); break;
-        case 49: vpx2_isa_jmprs(); break;
-        case 50: vpx2_isa_zjmp(); break;
-        case 51: vpx2_isa_ejmp(); break;
-        case 52: vpx2_isa_nejmp(); break;
-        case 53: vpx2_isa_gjmp(); break;
-        case 54: vpx2_isa_gejmp(); break;
-        case 55: vpx2_isa_sjmp(); break;
-        case 56: vpx2_isa_sejmp(); break;
-        case 57: vpx2_isa_cjmp(); break;
+        case 46: vpx2_isa_jmp(); return vpx2_block_end();
+        case 47: vpx2_isa_jmpr(); return vpx2_block_end();
+        case 48: vpx2_isa_jmps(); return vpx2_block_end();
+        case 49: vpx2_isa_jmprs(); return vpx2_block_end();
+        case 50: vpx2_isa_zjmp(); return vpx2_block_end();
+        case 51: vpx2_isa_ejmp(); return vpx2_block_end();
+        case 52: vpx2_isa_nejmp(); return vpx2_block_end();
+        case 53: vpx2_isa_gjmp(); return vpx2_block_end();
+        case 54: vpx2_isa_gejmp(); return vpx2_block_end();
+        case 55: vpx2_isa_sjmp(); return vpx2_block_end();
+        case 56: vpx2_isa_sejmp(); return vpx2_block_end();
+        case 57: vpx2_isa_cjmp(); return vpx2_block_end();
         case 58: vpx2_isa_push8(); break;
         case 59: vpx2_isa_push16(); break;
         case 60: vpx2_isa_push32(); break;
         case 61: vpx2_isa_pop8(); break;
         case 62: vpx2_isa_pop16(); break;
         case 63: vpx2_isa_pop32(); break;
-        case 64: vpx2_isa_call(); break;
-        case 65: vpx2_isa_callr(); break;
-        case 66: vpx2_isa_ret(); break;
+        case 64: vpx2_isa_call(); return vpx2_block_end();
+        case 65: vpx2_isa_callr(); return vpx2_block_end();
+        case 66: {
+            vpx2_isa_ret();
+            if(__builtin_expect(vpx2_registers[VPX_RPC] == VPX_CALL_RETURN, 0) && vpx2_call_depth != 0){
+                return 4; //Back to vpx2_call.
+            }
+            return vpx2_block_end();
+        }
 
-        
+        #ifdef VPX_ISA_ATOMIC
+        case 67: vpx2_isa_ald32(); break;
+        case 68: vpx2_isa_ast32(); break;
+        case 69: vpx2_isa_acas(); break;
+        case 70: vpx2_isa_aadd(); break;
+        case 71: vpx2_isa_fence(); break;
+        #endif
+
+        #ifdef VPX_ISA_CONTEXTS
+        case 72: vpx2_isa_ctxbase(); break;
+        case 73: vpx2_isa_swctx(); return vpx2_block_end();
+        #endif
 
 
 
@@ -1784,27 +2307,46 @@ static inline uint8_t vpx2_exec(){
         case 43: vpx2_isa_st8r(); break;
         case 44: vpx2_isa_st16r(); break;
         case 45: vpx2_isa_st32r(); break;
-        case 46: vpx2_isa_jmp(); break;
-        case 47: vpx2_isa_jmpr(); break;
-        case 48: vpx2_isa_jmps(); break;
-        case 49: vpx2_isa_jmprs(); break;
-        case 50: vpx2_isa_zjmp(); break;
-        case 51: vpx2_isa_ejmp(); break;
-        case 52: vpx2_isa_nejmp(); break;
-        case 53: vpx2_isa_gjmp(); break;
-        case 54: vpx2_isa_gejmp(); break;
-        case 55: vpx2_isa_sjmp(); break;
-        case 56: vpx2_isa_sejmp(); break;
-        case 57: vpx2_isa_cjmp(); break;
+        case 46: vpx2_isa_jmp(); return vpx2_block_end();
+        case 47: vpx2_isa_jmpr(); return vpx2_block_end();
+        case 48: vpx2_isa_jmps(); return vpx2_block_end();
+        case 49: vpx2_isa_jmprs(); return vpx2_block_end();
+        case 50: vpx2_isa_zjmp(); return vpx2_block_end();
+        case 51: vpx2_isa_ejmp(); return vpx2_block_end();
+        case 52: vpx2_isa_nejmp(); return vpx2_block_end();
+        case 53: vpx2_isa_gjmp(); return vpx2_block_end();
+        case 54: vpx2_isa_gejmp(); return vpx2_block_end();
+        case 55: vpx2_isa_sjmp(); return vpx2_block_end();
+        case 56: vpx2_isa_sejmp(); return vpx2_block_end();
+        case 57: vpx2_isa_cjmp(); return vpx2_block_end();
         case 58: vpx2_isa_push8(); break;
         case 59: vpx2_isa_push16(); break;
         case 60: vpx2_isa_push32(); break;
         case 61: vpx2_isa_pop8(); break;
         case 62: vpx2_isa_pop16(); break;
         case 63: vpx2_isa_pop32(); break;
-        case 64: vpx2_isa_call(); break;
-        case 65: vpx2_isa_callr(); break;
-        case 66: vpx2_isa_ret(); break;
+        case 64: vpx2_isa_call(); return vpx2_block_end();
+        case 65: vpx2_isa_callr(); return vpx2_block_end();
+        case 66: {
+            vpx2_isa_ret();
+            if(__builtin_expect(vpx2_registers[VPX_RPC] == VPX_CALL_RETURN, 0) && vpx2_call_depth != 0){
+                return 4; //Back to vpx2_call.
+            }
+            return vpx2_block_end();
+        }
+
+        #ifdef VPX_ISA_ATOMIC
+        case 67: vpx2_isa_ald32(); break;
+        case 68: vpx2_isa_ast32(); break;
+        case 69: vpx2_isa_acas(); break;
+        case 70: vpx2_isa_aadd(); break;
+        case 71: vpx2_isa_fence(); break;
+        #endif
+
+        #ifdef VPX_ISA_CONTEXTS
+        case 72: vpx2_isa_ctxbase(); break;
+        case 73: vpx2_isa_swctx(); return vpx2_block_end();
+        #endif
 
         #ifdef VPX_ISA_64
         //64 bit versions
@@ -1836,6 +2378,30 @@ static inline uint8_t vpx2_exec(){
 
 //[[ PRIMARY FUNCTIONS ]]
 
+static inline uint32_t vpx2_mem_bytes(uint32_t mem_size){
+    //Bytes the host has to allocate for a guest memory of mem_size.
+    #ifdef VPX_MASKED
+    return mem_size + VPX_MASK_PAD;
+    #else
+    return mem_size;
+    #endif
+}
+
+#ifdef VPX_MASKED
+static inline uint32_t vpx2_mem_pow2(uint32_t size){
+    //Rounds a memory size up to the next power of two for masked mode.
+    //Returns 0 if it doesn't fit (more than 2 GB).
+    if(size == 0 || size > 0x80000000u){
+        return 0;
+    }
+    uint32_t p = 1;
+    while(p < size){
+        p <<= 1;
+    }
+    return p;
+}
+#endif
+
 static inline uint8_t vpx2_init(uint8_t* mem_ptr, uint32_t mem_size){
     if(mem_ptr == VPXNULL){
         return 1; //Fail
@@ -1843,6 +2409,13 @@ static inline uint8_t vpx2_init(uint8_t* mem_ptr, uint32_t mem_size){
     if(mem_size == 0){
         return 1; //Fail
     }
+    #ifdef VPX_MASKED
+    //mem_size must be a power of two (see vpx2_mem_pow2), mem_ptr must have VPX_MASK_PAD extra bytes.
+    if(mem_size & (mem_size - 1)){
+        return 1; //Fail
+    }
+    vpx2_mem_mask = mem_size - 1;
+    #endif
     vpx2_mem_ptr = mem_ptr;
     vpx2_mem_size = mem_size;
 
@@ -1850,17 +2423,743 @@ static inline uint8_t vpx2_init(uint8_t* mem_ptr, uint32_t mem_size){
 
 
 }
-static inline uint8_t vpx2_start(){
+//[[ VM STATE ]]
+//Everything needed to suspend a VM and resume it later, possibly in another process.
+//The memory itself is only referenced, the host owns it.
+typedef struct {
+    uint32_t registers[64];
+    uint8_t* mem_ptr;
+    uint32_t mem_size;
+
+    uint8_t err_code;
+    uint32_t err_val;
+    uint32_t err_pc_state;
+
+    #ifdef VPX_TRAPS
+    uint32_t ivt;
+    uint32_t timer_period;
+    uint32_t timer_left;
+    #endif
+
+    #ifdef VPX_ISA_CONTEXTS
+    uint32_t ctx_base;
+    uint32_t ctx_count;
+    uint32_t ctx_current;
+    #endif
+} vpx2_state;
+
+static inline void vpx2_state_save(vpx2_state* st){
+    memcpy(st->registers, vpx2_registers, sizeof(vpx2_registers));
+    st->mem_ptr = vpx2_mem_ptr;
+    st->mem_size = vpx2_mem_size;
+    st->err_code = vpx2_err_code;
+    st->err_val = vpx2_err_val;
+    st->err_pc_state = vpx2_err_pc_state;
+    #ifdef VPX_TRAPS
+    st->ivt = vpx2_ivt;
+    st->timer_period = vpx2_timer_period;
+    st->timer_left = vpx2_timer_left;
+    #endif
+    #ifdef VPX_ISA_CONTEXTS
+    st->ctx_base = vpx2_ctx_base;
+    st->ctx_count = vpx2_ctx_count;
+    st->ctx_current = vpx2_ctx_current;
+    #endif
+}
+static inline void vpx2_state_load(const vpx2_state* st){
+    memcpy(vpx2_registers, st->registers, sizeof(vpx2_registers));
+    vpx2_mem_ptr = st->mem_ptr;
+    vpx2_mem_size = st->mem_size;
+    #ifdef VPX_MASKED
+    vpx2_mem_mask = st->mem_size - 1;
+    #endif
+    vpx2_err_code = st->err_code;
+    vpx2_err_val = st->err_val;
+    vpx2_err_pc_state = st->err_pc_state;
+    #ifdef VPX_TRAPS
+    vpx2_ivt = st->ivt;
+    vpx2_timer_period = st->timer_period;
+    vpx2_timer_left = st->timer_left;
+    #endif
+    #ifdef VPX_ISA_CONTEXTS
+    vpx2_ctx_base = st->ctx_base;
+    vpx2_ctx_count = st->ctx_count;
+    vpx2_ctx_current = st->ctx_current;
+    #endif
+}
+
+#ifdef VPX_DIRTY
+static inline void vpx2_reset(const vpx2_state* pristine, const uint8_t* pristine_mem){
+    //Puts the loaded VM back to a pristine state, only copying the pages that
+    //were written since the last reset (or since the dirty map was cleared).
+    //pristine_mem is a copy of the memory at that point, same size as the current memory.
+    //Memory pointer and size of the loaded VM are kept.
+    uint32_t bytes = vpx2_mem_bytes(vpx2_mem_size);
+    uint32_t pages = VPX_DIRTY_PAGES(vpx2_mem_size);
+    uint32_t p = 0;
+    while(p < pages){
+        //Skip clean pages 8 at a time.
+        uint64_t word = 0;
+        if(p + 8 <= pages){
+            memcpy(&word, &vpx2_dirty_map[p], 8);
+            if(word == 0){
+                p += 8;
+                continue;
+            }
+        }
+        if(vpx2_dirty_map[p]){
+            uint32_t off = p << VPX_PAGE_SHIFT;
+            if(off < bytes){
+                uint32_t len = bytes - off < VPX_PAGE_SIZE ? bytes - off : VPX_PAGE_SIZE;
+                memcpy(vpx2_mem_ptr + off, pristine_mem + off, len);
+            }
+            vpx2_dirty_map[p] = 0;
+        }
+        p++;
+    }
+
+    memcpy(vpx2_registers, pristine->registers, sizeof(vpx2_registers));
+    vpx2_err_code = pristine->err_code;
+    vpx2_err_val = pristine->err_val;
+    vpx2_err_pc_state = pristine->err_pc_state;
+    #ifdef VPX_TRAPS
+    vpx2_ivt = pristine->ivt;
+    vpx2_timer_period = pristine->timer_period;
+    vpx2_timer_left = pristine->timer_left;
+    #endif
+    #ifdef VPX_ISA_CONTEXTS
+    vpx2_ctx_base = pristine->ctx_base;
+    vpx2_ctx_count = pristine->ctx_count;
+    vpx2_ctx_current = pristine->ctx_current;
+    #endif
+}
+#endif
+
+#ifdef VPX_TRAPS
+static inline uint8_t vpx2_trap(uint8_t vector, uint32_t pc){
+    //Enters the guest handler for vector, returns 0 if there is one.
+    //Otherwise (or if the pushes fault) the original error stays as it was.
+    if(vpx2_ivt == 0){
+        return 1;
+    }
+    uint8_t err_code = vpx2_err_code;
+    uint32_t err_val = vpx2_err_val;
+    uint32_t err_pc_state = vpx2_err_pc_state;
+    vpx2_err_code = 0;
+    uint32_t handler = vpx2_mem_r32(vpx2_ivt + vector * 4);
+    if(vpx2_err_code == 0 && handler != 0){
+        vpx2_mem_pu32(pc);
+        vpx2_mem_pu32(vector == VPX_TRAP_TIMER ? 0 : err_val);
+        if(vpx2_err_code == 0){
+            vpx2_wreg(VPX_RPC, handler);
+            return 0;
+        }
+    }
+    //Double fault, report the first one.
+    vpx2_err_code = err_code;
+    vpx2_err_val = err_val;
+    vpx2_err_pc_state = err_pc_state;
+    return 1;
+}
+
+static inline uint32_t vpx2_trap_chunk(uint64_t left){
+    //Budget for exec up to whatever comes first, the caller's budget or the timer. 0 means 2^32.
+    uint64_t chunk = left;
+    if(vpx2_timer_period != 0 && vpx2_timer_left < chunk){
+        chunk = vpx2_timer_left;
+    }
+    return (uint32_t)chunk;
+}
+
+static inline uint64_t vpx2_trap_used(uint32_t chunk, uint32_t budget_left){
+    //Blocks run out of a chunk, charged to the timer too.
+    uint64_t used = (chunk == 0 ? 0x100000000ull : chunk) - budget_left;
+    if(vpx2_timer_period != 0){
+        vpx2_timer_left -= (uint32_t)used;
+    }
+    return used;
+}
+#endif
+
+static inline uint8_t vpx2_run(uint32_t budget){
+    //Runs until a hostcall, an error or until budget blocks have finished.
+    //A block ends at every jump, call and return, that's the only place the budget is counted.
+    //Returns VPX_RUN_*. A budget of 0 means 2^32 blocks.
+    #ifdef VPX_TRAPS
+    //The budget is handed to exec in chunks that end at the next timer tick.
+    uint64_t left = budget == 0 ? 0x100000000ull : budget; //Of the caller's budget, before this chunk
+    uint32_t chunk = vpx2_trap_chunk(left);
+    vpx2_budget = chunk;
+    while(1){
+        uint32_t pc; //Start of the last instruction, the handler's return address.
+        uint8_t rt;
+        do{
+            pc = vpx2_registers[VPX_RPC];
+            rt = vpx2_exec();
+        }while(rt == 0);
+        if(rt == 2){
+            left -= vpx2_trap_used(chunk, 0);
+            if(vpx2_timer_period != 0 && vpx2_timer_left == 0){
+                vpx2_timer_left = vpx2_timer_period;
+                vpx2_trap(VPX_TRAP_TIMER, vpx2_registers[VPX_RPC]); //Ignored without a handler.
+            }
+            if(left == 0){
+                return VPX_RUN_BUDGET;
+            }
+            chunk = vpx2_trap_chunk(left);
+            vpx2_budget = chunk;
+            continue;
+        }
+        if(rt == 1 && vpx2_trap(vpx2_err_code, pc) == 0){continue;}
+        left -= vpx2_trap_used(chunk, vpx2_budget);
+        vpx2_budget = (uint32_t)left; //What the caller sees as left over.
+    #else
+    vpx2_budget = budget;
     while(1){
         uint8_t rt = vpx2_exec();
-        if(rt == 1){return 1;} //error exit
-        if(rt == 255){return 0;} //hostcall successful exit.
+        if(rt == 0){continue;}
+    #endif
+        if(rt == 1){return VPX_RUN_ERROR;}
+        if(rt == 255){return VPX_RUN_HOSTCALL;}
+        if(rt == 4){return VPX_RUN_RETURNED;}
+        if(rt == 3){
+            #ifndef VPX_HARTS
+            __atomic_store_n(&vpx2_interrupted, 0, __ATOMIC_RELAXED);
+            #endif
+            vpx2_err_pc_state = vpx2_registers[VPX_RPC];
+            return VPX_RUN_INTERRUPTED;
+        }
+        return VPX_RUN_BUDGET;
+    }
+}
+
+static inline void vpx2_interrupt(){
+    //Stops the running VM at its next jump, call or return. Safe from any thread
+    //(and from signal handlers), vpx2_run / vpx2_start return VPX_RUN_INTERRUPTED.
+    //If no VM is running the next one stops right after its first block.
+    //With VPX_HARTS it stops every hart and stays set until the host clears vpx2_interrupted.
+    __atomic_store_n(&vpx2_interrupted, 1, __ATOMIC_RELAXED);
+}
 
+static inline uint8_t vpx2_start(){
+    while(1){
+        uint8_t rt = vpx2_run(0);
+        if(rt == VPX_RUN_ERROR){return 1;} //error exit
+        if(rt == VPX_RUN_HOSTCALL){return 0;} //hostcall successful exit.
+        if(rt == VPX_RUN_INTERRUPTED){return VPX_RUN_INTERRUPTED;}
+        //Budget ran out, no limit here so just keep going.
     }
     return 0;
 
 
 }
 
+static inline uint8_t vpx2_call(uint32_t entry, const uint32_t* args, uint32_t argc, uint32_t* result,
+                                uint32_t slice, uint8_t (*host)(uint8_t why)){
+    //Calls the guest function at entry on the loaded VM and runs it until it returns.
+    //args go to r0 and up (VPX_CALL_ARGS at most), VPX_CALL_RETURN is pushed as the return
+    //address. When the function's ret pops it, r0 - r7 are copied to result (can be VPXNULL).
+    //host gets every hostcall (why = VPX_RUN_HOSTCALL) and the end of every slice blocks
+    //(VPX_RUN_BUDGET), nonzero stops the call. Without a host a hostcall stops it.
+    //Every register is put back afterwards, so a hostcall handler can call into the guest
+    //and then let the guest carry on after the hostcall as usual. Calls nest.
+    //An error stays in vpx2_err_*, clear vpx2_err_code before running the VM again.
+    //Returns VPX_RUN_RETURNED, VPX_RUN_ERROR, VPX_RUN_INTERRUPTED, or the why it stopped on.
+    uint32_t saved[64];
+    memcpy(saved, vpx2_registers, sizeof(saved));
+    for(uint32_t i = 0; i < argc && i < VPX_CALL_ARGS; i++){
+        vpx2_registers[i] = args[i];
+    }
+    uint8_t rt = VPX_RUN_ERROR;
+    vpx2_mem_pu32(VPX_CALL_RETURN);
+    if(vpx2_err_code == 0){
+        vpx2_wreg(VPX_RPC, entry);
+        vpx2_call_depth++;
+        while(1){
+            rt = vpx2_run(slice);
+            if(rt != VPX_RUN_HOSTCALL && rt != VPX_RUN_BUDGET){break;}
+            if(host == VPXNULL ? rt == VPX_RUN_HOSTCALL : host(rt) != 0){break;}
+        }
+        vpx2_call_depth--;
+    }
+    if(rt == VPX_RUN_RETURNED && result != VPXNULL){
+        memcpy(result, vpx2_registers, VPX_CALL_ARGS * sizeof(uint32_t));
+    }
+    memcpy(vpx2_registers, saved, sizeof(saved));
+    return rt;
+}
+
+//[[ BATCH ]]
+#ifdef VPX_BATCH
+//Lockstep execution of VPX_BATCH_LANES VMs of the same image (clones of one warmed VM).
+//Registers are stored per register, not per VM (regs[reg][lane]), so an ALU opcode is
+//one loop over the lanes that the compiler turns into host SIMD.
+//Every lane keeps its own PC. Each step runs the group of lanes at the lowest PC and masks
+//out the rest, so lanes that went different ways run one after the other and merge again
+//where their paths meet (after an if/else, when a loop exits...).
+//Opcodes without a lane loop (stack, calls, division, extensions) and loads or stores that
+//would fault run through vpx2_exec one lane at a time, a lane always does exactly what a
+//lone VM would. Trap vectors aren't used, an error stops the lane.
+//Code is fetched from the first lane of the group, lanes must not patch their code differently.
+//With VPX_DIRTY every lane marks its stores in the one vpx2_dirty_map, so the map only says
+//that some lane wrote a page, not which one.
+typedef struct {
+    uint32_t regs[64][VPX_BATCH_LANES] __attribute__((aligned(64)));
+    vpx2_state lane[VPX_BATCH_LANES]; //Everything but the registers, lane[].registers is stale.
+    uint8_t state[VPX_BATCH_LANES]; //VPX_LANE_*
+} vpx2_batch;
+
+#define VPX_BATCH_EACH(l) for(uint32_t l = 0; l < VPX_BATCH_LANES; l++)
+
+//{length, register operands} of the opcodes with a lane loop, length 0 goes through vpx2_exec.
+static const uint8_t vpx2_batch_ops[64][2] = {
+    [0] = {1, 0}, [1] = {1, 0}, [3] = {3, 2}, [5] = {2, 1}, [6] = {2, 1},
+    [7] = {4, 3}, [8] = {4, 3}, [9] = {4, 3}, [10] = {3, 2},
+    [11] = {7, 2}, [12] = {7, 2}, [13] = {7, 2},
+    [14] = {4, 3}, [15] = {4, 3}, [16] = {4, 3}, [17] = {4, 2}, [18] = {4, 2}, [19] = {4, 2},
+    [20] = {4, 3}, [21] = {4, 3}, [22] = {4, 3}, [27] = {7, 2}, [28] = {7, 2}, [29] = {7, 2},
+    [40] = {7, 2}, [41] = {7, 2}, [42] = {7, 2}, [43] = {7, 2}, [44] = {7, 2}, [45] = {7, 2},
+    [46] = {5, 0}, [50] = {6, 1}, [51] = {7, 2}, [52] = {7, 2}, [53] = {7, 2},
+    [54] = {7, 2}, [55] = {7, 2}, [56] = {7, 2},
+};
+
+static inline void vpx2_batch_init(vpx2_batch* b){
+    memset(b, 0, sizeof(*b));
+    VPX_BATCH_EACH(l){
+        b->state[l] = VPX_LANE_IDLE;
+    }
+}
+
+static inline void vpx2_batch_set(vpx2_batch* b, uint32_t l, const vpx2_state* st){
+    //Puts a VM into lane l, the caller sets b->state[l].
+    b->lane[l] = *st;
+    for(uint32_t r = 0; r < 64; r++){
+        b->regs[r][l] = st->registers[r];
+    }
+}
+
+static inline void vpx2_batch_get(const vpx2_batch* b, uint32_t l, vpx2_state* st){
+    *st = b->lane[l];
+    for(uint32_t r = 0; r < 64; r++){
+        st->registers[r] = b->regs[r][l];
+    }
+}
+
+static inline void vpx2_batch_put(vpx2_batch* b, uint8_t r, const uint32_t* val, const uint32_t* act){
+    //Writes val to register r of the active lanes.
+    VPX_BATCH_EACH(l){
+        b->regs[r][l] = (val[l] & act[l]) | (b->regs[r][l] & ~act[l]);
+    }
+}
+
+static inline uint8_t vpx2_batch_scalar(vpx2_batch* b, const uint32_t* mask){
+    //Runs the next instruction of the masked lanes on the loaded VM, one lane after another.
+    //Returns 2 if it ended a block, 3 if the VM was interrupted.
+    uint8_t end = 0;
+    VPX_BATCH_EACH(l){
+        if(!mask[l]){continue;}
+        vpx2_state st;
+        vpx2_batch_get(b, l, &st);
+        vpx2_state_load(&st);
+        vpx2_budget = 1; //So a block end shows up as 2.
+        uint8_t rt = vpx2_exec();
+        vpx2_state_save(&st);
+        vpx2_batch_set(b, l, &st);
+        if(rt == 1){
+            b->state[l] = VPX_LANE_ERROR;
+        }else if(rt == 255){
+            b->state[l] = VPX_LANE_HOSTCALL;
+        }else if(rt > end){
+            end = rt;
+        }
+    }
+    return end;
+}
+
+static inline uint32_t vpx2_batch_imm(const uint8_t* code){
+    uint32_t imm;
+    memcpy(&imm, code, 4);
+    return vpx2_32b_endian_fmt(imm);
+}
+
+static inline uint8_t vpx2_batch_run(vpx2_batch* b, uint32_t budget){
+    //Runs the lanes in VPX_LANE_RUN until none is left (VPX_RUN_HOSTCALL, b->state says why
+    //each one stopped) or until budget blocks have finished. A branch run by a group of lanes
+    //is one block. Blocks left over end up in vpx2_budget, like with vpx2_run.
+    //Uses the loaded VM as scratch space. A budget of 0 means 2^32 blocks.
+    uint32_t act[VPX_BATCH_LANES]; //All ones for the lanes in the running group
+    uint32_t run[VPX_BATCH_LANES]; //All ones for the lanes in VPX_LANE_RUN
+    uint32_t val[VPX_BATCH_LANES];
+    uint32_t pc = 0;
+    uint32_t group = 0; //Lanes in it
+    uint8_t whole = 0; //Group has every runnable lane, code without branches keeps it that way.
+    uint8_t stopped = 1; //A lane left VPX_LANE_RUN, run[] is stale.
+    uint32_t runnable = 0;
+    uint32_t left = budget;
+    while(1){
+        if(stopped){
+            runnable = 0;
+            VPX_BATCH_EACH(l){
+                run[l] = b->state[l] == VPX_LANE_RUN ? 0xFFFFFFFF : 0;
+                runnable += run[l] & 1;
+            }
+            if(runnable == 0){
+                vpx2_budget = left;
+                return VPX_RUN_HOSTCALL;
+            }
+            stopped = 0;
+            whole = 0;
+        }
+        if(!whole){
+            //[[ PICK GROUP ]]
+            pc = 0xFFFFFFFF;
+            VPX_BATCH_EACH(l){
+                uint32_t lane_pc = b->regs[VPX_RPC][l] | ~run[l];
+                pc = lane_pc < pc ? lane_pc : pc;
+            }
+            group = 0;
+            VPX_BATCH_EACH(l){
+                act[l] = b->regs[VPX_RPC][l] == pc ? run[l] : 0;
+                group += act[l] & 1;
+            }
+            whole = group == runnable;
+        }
+
+        //[[ DECODE ]]
+        uint32_t lead = 0;
+        while(!act[lead]){
+            lead++;
+        }
+        const uint8_t* code = b->lane[lead].mem_ptr + pc;
+        uint8_t opcode = 0xFF; //PC outside the memory, exec reports it.
+        uint8_t len = 0;
+        if((uint64_t)pc + 7 <= b->lane[lead].mem_size){
+            opcode = code[0];
+        }
+        if(opcode < 64){
+            len = vpx2_batch_ops[opcode][0];
+            for(uint8_t i = 1; i <= vpx2_batch_ops[opcode][1]; i++){
+                len = code[i] < 64 ? len : 0; //Bad register, exec reports it.
+            }
+            if(opcode >= 3 && opcode <= 42 && code[1] == VPX_RPC){
+                len = 0; //Writes the PC, exec moves the lane and the group gets picked again.
+            }
+        }
+        #ifdef VPX_STREAM
+        if(__atomic_load_n(&vpx2_streaming, __ATOMIC_ACQUIRE)){
+            len = 0; //Only exec waits for pages.
+        }
+        #endif
+        uint8_t end = 0; //2 when a block ended, 3 when interrupted
+        if(len == 0){
+            end = vpx2_batch_scalar(b, act);
+            stopped = 1;
+        }else{
+            //Operands see the PC past the instruction, like in vpx2_exec.
+            VPX_BATCH_EACH(l){
+                b->regs[VPX_RPC][l] += len & act[l];
+            }
+            uint8_t r1 = code[1];
+            uint8_t r2 = code[2];
+            uint8_t r3 = code[3];
+            #define VPX_BATCH_SET(expr) VPX_BATCH_EACH(l){val[l] = (expr);} vpx2_batch_put(b, r1, val, act); break
+            #define VPX_BATCH_JUMP(cond) VPX_BATCH_EACH(l){val[l] = (cond) ? act[l] : 0;} end = 2; break
+            switch(opcode){
+                case 0: break;
+                case 1: {
+                    VPX_BATCH_EACH(l){
+                        b->state[l] = act[l] ? VPX_LANE_HOSTCALL : b->state[l];
+                    }
+                    stopped = 1;
+                    break;
+                }
+                case 3: VPX_BATCH_SET(b->regs[r2][l]);
+                case 5: VPX_BATCH_SET(b->regs[r1][l] + 1);
+                case 6: VPX_BATCH_SET(b->regs[r1][l] - 1);
+                case 7: VPX_BATCH_SET(b->regs[r2][l] | b->regs[r3][l]);
+                case 8: VPX_BATCH_SET(b->regs[r2][l] ^ b->regs[r3][l]);
+                case 9: VPX_BATCH_SET(b->regs[r2][l] & b->regs[r3][l]);
+                case 10: VPX_BATCH_SET(~b->regs[r2][l]);
+                case 11: VPX_BATCH_SET(b->regs[r2][l] | vpx2_batch_imm(code + 3));
+                case 12: VPX_BATCH_SET(b->regs[r2][l] ^ vpx2_batch_imm(code + 3));
+                case 13: VPX_BATCH_SET(b->regs[r2][l] & vpx2_batch_imm(code + 3));
+                //Shift counts wrap at 32 like the host's scalar shifts do.
+                case 14: VPX_BATCH_SET(b->regs[r2][l] << (b->regs[r3][l] & 31));
+                case 15: VPX_BATCH_SET(b->regs[r2][l] >> (b->regs[r3][l] & 31));
+                case 16: VPX_BATCH_SET((uint32_t)((int32_t)b->regs[r2][l] >> (b->regs[r3][l] & 31)));
+                case 17: VPX_BATCH_SET(b->regs[r2][l] << (r3 & 31));
+                case 18: VPX_BATCH_SET(b->regs[r2][l] >> (r3 & 31));
+                case 19: VPX_BATCH_SET((uint32_t)((int32_t)b->regs[r2][l] >> (r3 & 31)));
+                case 20: VPX_BATCH_SET(b->regs[r2][l] + b->regs[r3][l]);
+                case 21: VPX_BATCH_SET(b->regs[r2][l] - b->regs[r3][l]);
+                case 22: VPX_BATCH_SET(b->regs[r2][l] * b->regs[r3][l]);
+                case 27: VPX_BATCH_SET(b->regs[r2][l] + vpx2_batch_imm(code + 3));
+                case 28: VPX_BATCH_SET(b->regs[r2][l] - vpx2_batch_imm(code + 3));
+                case 29: VPX_BATCH_SET(b->regs[r2][l] * vpx2_batch_imm(code + 3));
+                case 40: case 41: case 42:
+                case 43: case 44: case 45: {
+                    //One access per lane into its own memory. Faulting lanes go through exec.
+                    uint8_t store = opcode >= 43;
+                    uint32_t size = 1u << ((opcode - 40) % 3);
+                    uint32_t imm = vpx2_batch_imm(code + 3);
+                    imm = store ? imm : (uint8_t)imm; //Same 8 bit offset as vpx2_isa_ld*r.
+                    uint32_t slow[VPX_BATCH_LANES];
+                    uint8_t any_slow = 0;
+                    VPX_BATCH_EACH(l){
+                        val[l] = b->regs[r1][l];
+                        slow[l] = 0;
+                        if(!act[l]){continue;}
+                        uint32_t adr = b->regs[r2][l] + imm;
+                        uint8_t* mem = b->lane[l].mem_ptr;
+                        //Same limits as the VPX_SAFE vpx2_mem_r*/w*, so a lane faults where a lone VM would.
+                        if(adr >= b->lane[l].mem_size - (size == 1 ? 0 : size)){
+                            slow[l] = 0xFFFFFFFF;
+                            any_slow = 1;
+                        }else if(store){
+                            uint16_t v16 = vpx2_16b_endian_fmt(val[l]);
+                            uint32_t v32 = vpx2_32b_endian_fmt(val[l]);
+                            if(size == 1){mem[adr] = val[l];}
+                            else if(size == 2){memcpy(mem + adr, &v16, 2);}
+                            else{memcpy(mem + adr, &v32, 4);}
+                            vpx2_mem_mark(adr, size);
+                        }else{
+                            uint16_t v16;
+                            uint32_t v32;
+                            if(size == 1){val[l] = mem[adr];}
+                            else if(size == 2){memcpy(&v16, mem + adr, 2); val[l] = vpx2_16b_endian_fmt(v16);}
+                            else{memcpy(&v32, mem + adr, 4); val[l] = vpx2_32b_endian_fmt(v32);}
+                        }
+                    }
+                    if(!store){
+                        vpx2_batch_put(b, r1, val, act);
+                    }
+                    if(any_slow){
+                        VPX_BATCH_EACH(l){
+                            b->regs[VPX_RPC][l] -= len & slow[l];
+                        }
+                        end = vpx2_batch_scalar(b, slow);
+                        stopped = 1;
+                    }
+                    break;
+                }
+                //val is all ones for the lanes that take the branch.
+                case 46: VPX_BATCH_JUMP(1);
+                case 50: VPX_BATCH_JUMP(b->regs[r1][l] == 0);
+                case 51: VPX_BATCH_JUMP(b->regs[r1][l] == b->regs[r2][l]);
+                case 52: VPX_BATCH_JUMP(b->regs[r1][l] != b->regs[r2][l]);
+                case 53: VPX_BATCH_JUMP(b->regs[r1][l] > b->regs[r2][l]);
+                case 54: VPX_BATCH_JUMP(b->regs[r1][l] >= b->regs[r2][l]);
+                case 55: VPX_BATCH_JUMP(b->regs[r1][l] < b->regs[r2][l]);
+                case 56: VPX_BATCH_JUMP(b->regs[r1][l] <= b->regs[r2][l]);
+            }
+            #undef VPX_BATCH_SET
+            #undef VPX_BATCH_JUMP
+            if(end == 2 && opcode >= 46){
+                //[[ BRANCH ]]
+                uint32_t target = pc + vpx2_batch_imm(code + (opcode == 46 ? 1 : opcode == 50 ? 2 : 3));
+                uint32_t taken = 0;
+                VPX_BATCH_EACH(l){
+                    b->regs[VPX_RPC][l] = (target & val[l]) | (b->regs[VPX_RPC][l] & ~val[l]);
+                    taken += val[l] & 1;
+                }
+                if(taken != 0 && taken != group){
+                    whole = 0; //Diverged.
+                }
+                pc = taken != 0 ? target : pc + len;
+            }else{
+                pc += len;
+            }
+        }
+
+        //[[ BLOCK END ]]
+        if(end == 2 && __builtin_expect(__atomic_load_n(&vpx2_interrupted, __ATOMIC_RELAXED), 0)){
+            end = 3;
+        }
+        if(end == 3){
+            #ifndef VPX_HARTS
+            __atomic_store_n(&vpx2_interrupted, 0, __ATOMIC_RELAXED);
+            #endif
+            vpx2_budget = left;
+            return VPX_RUN_INTERRUPTED;
+        }
+        if(end == 2 && --left == 0){
+            vpx2_budget = 0;
+            return VPX_RUN_BUDGET;
+        }
+    }
+}
+#endif
+
+//[[ INTERLEAVE ]]
+#ifdef VPX_INTERLEAVE
+//VPX_INTERLEAVE_WAYS independent VMs on one host thread, switched after every block.
+//Before a VM is switched out its next block is scanned and the code and the data its loads
+//and stores will touch are prefetched. By the time its turn comes again (a block of every
+//other VM later) those cache misses have been served in the shadow of the other VMs' work
+//instead of stalling the core one after the other. Meant for guests hopping around in
+//memories far bigger than the cache, for anything else it's just slower than vpx2_run.
+//The scan costs about as much as running the block again, it only pays off where a miss
+//costs a lot more than that (big pages, no huge shared cache).
+//The scan runs the simple ALU ops of the block on a copy of the registers, so addresses
+//computed in the block itself are known too. Registers a load writes aren't.
+//Each way runs through vpx2_run, a way does exactly what a lone VM would.
+typedef struct {
+    vpx2_state vm[VPX_INTERLEAVE_WAYS];
+    uint8_t state[VPX_INTERLEAVE_WAYS]; //VPX_LANE_*
+    uint32_t next; //Way whose turn is next
+} vpx2_interleave;
+
+//Length of the opcodes the scan goes past, 0 ends it (block ends, extensions).
+static const uint8_t vpx2_interleave_len[256] = {
+    [0] = 1, [2] = 2, [3] = 3, [4] = 6, [5] = 2, [6] = 2, [7] = 4, [8] = 4, [9] = 4, [10] = 3,
+    [11] = 7, [12] = 7, [13] = 7, [14] = 4, [15] = 4, [16] = 4, [17] = 4, [18] = 4, [19] = 4,
+    [20] = 4, [21] = 4, [22] = 4, [23] = 4, [24] = 4, [25] = 4, [26] = 4,
+    [27] = 7, [28] = 7, [29] = 7, [30] = 7, [31] = 7, [32] = 7, [33] = 7,
+    [34] = 3, [35] = 3, [36] = 3, [37] = 3, [38] = 3, [39] = 3,
+    [40] = 7, [41] = 7, [42] = 7, [43] = 7, [44] = 7, [45] = 7,
+    [58] = 2, [59] = 2, [60] = 2, [61] = 2, [62] = 2, [63] = 2,
+};
+
+__attribute__((always_inline)) static inline void vpx2_interleave_touch(uint64_t known, uint8_t reg, uint32_t offset, const uint32_t* regs, uint8_t write){
+    //Prefetches regs[reg] + offset if it's known and in memory.
+    if(!(known >> reg & 1)){
+        return;
+    }
+    uint32_t adr = regs[reg] + offset;
+    #ifdef VPX_MASKED
+    adr &= vpx2_mem_mask;
+    #else
+    if(adr >= vpx2_mem_size){
+        return;
+    }
+    #endif
+    if(write){
+        __builtin_prefetch(vpx2_mem_ptr + adr, 1);
+    }else{
+        __builtin_prefetch(vpx2_mem_ptr + adr, 0);
+    }
+}
+
+__attribute__((always_inline)) static inline void vpx2_interleave_prefetch(){
+    //Prefetches the next block of the loaded VM, stops at its end or after VPX_INTERLEAVE_SCAN.
+    //Both are always_inline, GCC takes a function doing nothing but prefetches for const
+    //and drops the calls.
+    uint32_t regs[64];
+    memcpy(regs, vpx2_registers, sizeof(regs));
+    uint64_t known = ~0ull; //Registers the scan still has right
+    uint32_t pc = regs[VPX_RPC];
+    uint32_t line = ~0u;
+    for(uint32_t n = 0; n < VPX_INTERLEAVE_SCAN; n++){
+        if(vpx2_mem_size < 8 || pc > vpx2_mem_size - 8){
+            return;
+        }
+        const uint8_t* ip = vpx2_mem_ptr + pc;
+        if(pc >> 6 != line){
+            line = pc >> 6;
+            __builtin_prefetch(ip, 0);
+        }
+        uint8_t len = vpx2_interleave_len[ip[0]];
+        if(len == 0){
+            return;
+        }
+        uint8_t r1 = ip[1] & 63;
+        uint8_t r2 = ip[2] & 63;
+        uint8_t r3 = ip[3] & 63;
+        uint32_t imm;
+        memcpy(&imm, ip + 3, 4);
+        imm = vpx2_32b_endian_fmt(imm);
+        uint64_t k2 = known >> r2 & 1;
+        uint64_t k23 = k2 & known >> r3;
+        uint32_t val = 0;
+        uint64_t ok = 0; //r1 is known after this op
+        switch(ip[0]){
+            default: break; //Writes r1 some other way.
+            case 0: pc += len; continue;
+            case 3: val = regs[r2]; ok = k2; break;
+            case 4: memcpy(&val, ip + 2, 4); val = (uint8_t)vpx2_32b_endian_fmt(val); ok = 1; break;
+            case 5: val = regs[r1] + 1; ok = known >> r1 & 1; break;
+            case 6: val = regs[r1] - 1; ok = known >> r1 & 1; break;
+            case 7: val = regs[r2] | regs[r3]; ok = k23; break;
+            case 8: val = regs[r2] ^ regs[r3]; ok = k23; break;
+            case 9: val = regs[r2] & regs[r3]; ok = k23; break;
+            case 11: val = regs[r2] | imm; ok = k2; break;
+            case 12: val = regs[r2] ^ imm; ok = k2; break;
+            case 13: val = regs[r2] & imm; ok = k2; break;
+            case 14: val = regs[r2] << (regs[r3] & 31); ok = k23; break;
+            case 15: val = regs[r2] >> (regs[r3] & 31); ok = k23; break;
+            case 17: val = regs[r2] << (ip[3] & 31); ok = k2; break;
+            case 18: val = regs[r2] >> (ip[3] & 31); ok = k2; break;
+            case 20: val = regs[r2] + regs[r3]; ok = k23; break;
+            case 21: val = regs[r2] - regs[r3]; ok = k23; break;
+            case 22: val = regs[r2] * regs[r3]; ok = k23; break;
+            case 27: val = regs[r2] + imm; ok = k2; break;
+            case 28: val = regs[r2] - imm; ok = k2; break;
+            case 29: val = regs[r2] * imm; ok = k2; break;
+            case 34: case 35: case 36: vpx2_interleave_touch(known, r2, pc, regs, 0); break;
+            case 40: case 41: case 42: vpx2_interleave_touch(known, r2, (uint8_t)imm, regs, 0); break;
+            case 37: case 38: case 39: vpx2_interleave_touch(known, r2, pc, regs, 1); pc += len; continue;
+            case 43: case 44: case 45: vpx2_interleave_touch(known, r2, imm, regs, 1); pc += len; continue;
+            case 58: case 59: case 60: known &= ~(1ull << VPX_RSP); pc += len; continue;
+        }
+        regs[r1] = val;
+        known = (known & ~(1ull << r1)) | ok << r1;
+        if(ip[0] >= 58){
+            known &= ~(1ull << VPX_RSP); //pops
+        }
+        pc += len;
+    }
+}
+
+static inline void vpx2_interleave_init(vpx2_interleave* il){
+    for(uint32_t w = 0; w < VPX_INTERLEAVE_WAYS; w++){
+        il->state[w] = VPX_LANE_IDLE;
+    }
+    il->next = 0;
+}
+
+static inline uint8_t vpx2_interleave_run(vpx2_interleave* il, uint32_t budget){
+    //Runs the ways in VPX_LANE_RUN a block each in turn until one of them stops, il->state
+    //says which (VPX_RUN_HOSTCALL, also when none is left to run, or VPX_RUN_ERROR), or
+    //until budget blocks have run in all (VPX_RUN_BUDGET). VPX_RUN_INTERRUPTED leaves the
+    //interrupted way in VPX_LANE_RUN with its err_pc_state set. Blocks left in vpx2_budget.
+    //Whatever VM was loaded is overwritten, the ways are all in il->vm.
+    uint64_t left = budget == 0 ? 0x100000000ull : budget;
+    uint32_t w = il->next;
+    uint32_t idle = 0; //Ways in a row that aren't running
+    uint8_t rt = VPX_RUN_BUDGET;
+    while(left != 0){
+        if(il->state[w] != VPX_LANE_RUN){
+            if(++idle == VPX_INTERLEAVE_WAYS){
+                rt = VPX_RUN_HOSTCALL;
+                break;
+            }
+            w = (w + 1) % VPX_INTERLEAVE_WAYS;
+            continue;
+        }
+        idle = 0;
+        vpx2_state_load(&il->vm[w]);
+        uint8_t st = vpx2_run(1);
+        left -= 1 - vpx2_budget;
+        if(st == VPX_RUN_BUDGET){
+            vpx2_interleave_prefetch(); //Loads in flight while the others run.
+        }
+        vpx2_state_save(&il->vm[w]);
+        uint32_t way = w;
+        w = (w + 1) % VPX_INTERLEAVE_WAYS;
+        if(st == VPX_RUN_BUDGET){
+            continue;
+        }
+        if(st != VPX_RUN_INTERRUPTED){
+            il->state[way] = st == VPX_RUN_HOSTCALL ? VPX_LANE_HOSTCALL : VPX_LANE_ERROR;
+        }
+        rt = st == VPX_RUN_HOSTCALL || st == VPX_RUN_INTERRUPTED ? st : VPX_RUN_ERROR;
+        break;
+    }
+    il->next = w;
+    vpx2_budget = (uint32_t)left;
+    return rt;
+}
+#endif
+
 //[[ DEFINE MACRO ]]
 #define VPX_DEFINED
\ No newline at end of file
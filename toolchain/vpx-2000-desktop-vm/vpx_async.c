@@ -0,0 +1,321 @@
+//[[ ASYNC FILE I/O ]]
+//Non-blocking pread/pwrite hostcalls. Submitting gives the guest a ticket, it
+//keeps computing and polls or waits on the ticket later. Buffers are guest
+//memory, the kernel (or a pool thread) reads and writes them directly.
+//Backend is io_uring (raw syscalls, no liburing) when the kernel allows it,
+//otherwise a small thread pool doing plain pread/pwrite.
+//The guest must not touch a buffer until its ticket is done.
+//Tickets belong to the VM that submitted them (clones run side by side), other VMs
+//can't collect them and a clone's tickets are waited out before its memory is unmapped.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define VPX_ASYNC_SLOTS 256 //Tickets in flight, a ticket is a slot index.
+#define VPX_ASYNC_THREADS 4
+#define VPX_ASYNC_PENDING 0xFFFFFFFEu //Poll result while the request is still running.
+
+uint8_t async_use_pool = 0; //--async-pool, skip io_uring.
+
+#ifndef _WIN32
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define VPX_SLOT_FREE 0
+#define VPX_SLOT_PENDING 1
+#define VPX_SLOT_DONE 2
+
+typedef struct {
+    uint8_t state;
+    uint8_t out;     //pwrite
+    int fd;
+    uint8_t* buf;
+    const uint8_t* owner; //vpx2_mem_ptr of the VM that submitted it
+    uint32_t len;
+    uint64_t offset;
+    int32_t result;  //Bytes or -errno
+} vpx_async_slot;
+
+vpx_async_slot async_slots[VPX_ASYNC_SLOTS];
+uint8_t async_ready = 0; //Backend picked
+
+static uint32_t async_alloc(){
+    for(uint32_t i = 0; i < VPX_ASYNC_SLOTS; i++){
+        if(async_slots[i].state == VPX_SLOT_FREE){
+            return i;
+        }
+    }
+    return VPX_IO_ERR;
+}
+
+//== io_uring ==
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#ifndef VPX_ASYNC_URING
+#define VPX_ASYNC_URING
+#endif
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+int uring_fd = -1;
+uint32_t* uring_sq_tail;
+uint32_t* uring_sq_mask;
+uint32_t* uring_sq_array;
+struct io_uring_sqe* uring_sqes;
+uint32_t* uring_cq_head;
+uint32_t* uring_cq_tail;
+uint32_t* uring_cq_mask;
+struct io_uring_cqe* uring_cqes;
+
+static uint8_t uring_setup(){
+    //Returns 0 if io_uring works here.
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, VPX_ASYNC_SLOTS, &p);
+    if(fd < 0){
+        return 1;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    uint8_t* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uint8_t* cq = sq;
+    if(sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)){
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED){
+        close(fd);
+        return 1;
+    }
+    uring_sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+    uring_sq_mask = (uint32_t*)(sq + p.sq_off.ring_mask);
+    uring_sq_array = (uint32_t*)(sq + p.sq_off.array);
+    uring_sqes = sqes;
+    uring_cq_head = (uint32_t*)(cq + p.cq_off.head);
+    uring_cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+    uring_cq_mask = (uint32_t*)(cq + p.cq_off.ring_mask);
+    uring_cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    uring_fd = fd;
+    return 0;
+}
+
+static uint8_t uring_submit(uint32_t slot){
+    //Slots never outnumber the ring entries, so there's always room.
+    const vpx_async_slot* s = &async_slots[slot];
+    uint32_t tail = *uring_sq_tail;
+    uint32_t index = tail & *uring_sq_mask;
+    struct io_uring_sqe* sqe = &uring_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = s->out ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = s->fd;
+    sqe->addr = (uintptr_t)s->buf;
+    sqe->len = s->len;
+    sqe->off = s->offset;
+    sqe->user_data = slot;
+    uring_sq_array[index] = index;
+    __atomic_store_n(uring_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, uring_fd, 1, 0, 0, NULL, 0) == 1 ? 0 : 1;
+}
+
+static void uring_reap(){
+    uint32_t head = *uring_cq_head;
+    while(head != __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE)){
+        const struct io_uring_cqe* cqe = &uring_cqes[head & *uring_cq_mask];
+        vpx_async_slot* s = &async_slots[cqe->user_data];
+        s->result = cqe->res;
+        s->state = VPX_SLOT_DONE;
+        head++;
+    }
+    __atomic_store_n(uring_cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_wait(){
+    //Blocks until at least one more completion is posted.
+    syscall(__NR_io_uring_enter, uring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+#endif
+
+//== thread pool ==
+pthread_t async_threads[VPX_ASYNC_THREADS];
+pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t async_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;
+uint32_t async_queue[VPX_ASYNC_SLOTS]; //Ring of slots waiting for a thread
+uint32_t async_queue_head = 0;
+uint32_t async_queue_tail = 0;
+
+static void* async_worker(void* arg){
+    (void)arg;
+    pthread_mutex_lock(&async_lock);
+    while(1){
+        while(async_queue_head == async_queue_tail){
+            pthread_cond_wait(&async_work, &async_lock);
+        }
+        vpx_async_slot* s = &async_slots[async_queue[async_queue_head++ % VPX_ASYNC_SLOTS]];
+        pthread_mutex_unlock(&async_lock);
+
+        ssize_t n = s->out ? pwrite(s->fd, s->buf, s->len, s->offset) : pread(s->fd, s->buf, s->len, s->offset);
+        int32_t result = n < 0 ? -errno : (int32_t)n;
+
+        pthread_mutex_lock(&async_lock);
+        s->result = result;
+        s->state = VPX_SLOT_DONE;
+        pthread_cond_broadcast(&async_done);
+    }
+    return NULL;
+}
+
+static uint8_t pool_setup(){
+    for(uint32_t i = 0; i < VPX_ASYNC_THREADS; i++){
+        if(pthread_create(&async_threads[i], NULL, async_worker, NULL) != 0){
+            return i == 0; //A smaller pool still works.
+        }
+        pthread_detach(async_threads[i]);
+    }
+    return 0;
+}
+
+//== hostcall side ==
+static uint8_t async_setup(){
+    if(async_ready){
+        return 0;
+    }
+    #ifdef VPX_ASYNC_URING
+    if(!async_use_pool && uring_setup() == 0){
+        async_ready = 1;
+        return 0;
+    }
+    #endif
+    if(pool_setup() != 0){
+        return 1;
+    }
+    async_use_pool = 1;
+    async_ready = 1;
+    return 0;
+}
+
+uint32_t async_submit(uint8_t out, uint32_t fd, uint32_t adr, uint32_t len, uint64_t offset){
+    //Starts a pread/pwrite, returns the ticket.
+    int host_fd = io_fd(fd);
+    uint8_t* buf = vpx2_mem_host(adr, len, !out);
+    if(host_fd < 0 || buf == VPXNULL){
+        errno = host_fd < 0 ? EBADF : EFAULT;
+        return VPX_IO_ERR;
+    }
+    if(async_setup() != 0){
+        errno = ENOSYS;
+        return VPX_IO_ERR;
+    }
+
+    pthread_mutex_lock(&async_lock);
+    uint32_t slot = async_alloc();
+    if(slot == VPX_IO_ERR){
+        pthread_mutex_unlock(&async_lock);
+        errno = EAGAIN; //Too many in flight, collect some first.
+        return VPX_IO_ERR;
+    }
+    vpx_async_slot* s = &async_slots[slot];
+    s->state = VPX_SLOT_PENDING;
+    s->out = out;
+    s->fd = host_fd;
+    s->buf = buf;
+    s->owner = vpx2_mem_ptr;
+    s->len = len > 0x7FFFFFFF ? 0x7FFFFFFF : len;
+    s->offset = offset;
+    if(async_use_pool){
+        async_queue[async_queue_tail++ % VPX_ASYNC_SLOTS] = slot;
+        pthread_cond_signal(&async_work);
+    }
+    pthread_mutex_unlock(&async_lock);
+
+    #ifdef VPX_ASYNC_URING
+    if(!async_use_pool && uring_submit(slot) != 0){
+        s->state = VPX_SLOT_FREE;
+        return VPX_IO_ERR;
+    }
+    #endif
+    return slot;
+}
+
+static void async_wait(vpx_async_slot* s, uint8_t wait){
+    //Picks up finished requests, with wait until s is done. Holds async_lock.
+    #ifdef VPX_ASYNC_URING
+    if(!async_use_pool){
+        uring_reap();
+        while(wait && s->state != VPX_SLOT_DONE){
+            uring_wait();
+            uring_reap();
+        }
+    }
+    #endif
+    while(wait && s->state != VPX_SLOT_DONE){
+        pthread_cond_wait(&async_done, &async_lock);
+    }
+}
+
+uint32_t async_collect(uint32_t ticket, uint8_t wait){
+    //Result of a ticket: VPX_ASYNC_PENDING if it's still running (and wait is 0),
+    //else the byte count or VPX_IO_ERR with errno set. A collected ticket is free again.
+    if(ticket >= VPX_ASYNC_SLOTS){
+        errno = EINVAL;
+        return VPX_IO_ERR;
+    }
+    vpx_async_slot* s = &async_slots[ticket];
+    pthread_mutex_lock(&async_lock);
+    if(s->state == VPX_SLOT_FREE || s->owner != vpx2_mem_ptr){
+        pthread_mutex_unlock(&async_lock);
+        errno = EINVAL; //Not a ticket of this VM.
+        return VPX_IO_ERR;
+    }
+    async_wait(s, wait);
+    uint32_t rt;
+    if(s->state != VPX_SLOT_DONE){
+        rt = VPX_ASYNC_PENDING;
+    }else if(s->result < 0){
+        errno = -s->result;
+        rt = VPX_IO_ERR;
+        s->state = VPX_SLOT_FREE;
+    }else{
+        rt = s->result;
+        s->state = VPX_SLOT_FREE;
+    }
+    pthread_mutex_unlock(&async_lock);
+    return rt;
+}
+
+void async_release(const uint8_t* mem_ptr){
+    //Waits for the tickets of the VM with memory at mem_ptr and frees them,
+    //the kernel or a pool thread may still be writing into that memory.
+    if(!async_ready){
+        return;
+    }
+    pthread_mutex_lock(&async_lock);
+    for(uint32_t i = 0; i < VPX_ASYNC_SLOTS; i++){
+        vpx_async_slot* s = &async_slots[i];
+        if(s->state == VPX_SLOT_FREE || s->owner != mem_ptr){continue;}
+        async_wait(s, 1);
+        s->state = VPX_SLOT_FREE;
+    }
+    pthread_mutex_unlock(&async_lock);
+}
+
+#else
+uint32_t async_submit(uint8_t out, uint32_t fd, uint32_t adr, uint32_t len, uint64_t offset){
+    //No async backend on windows.
+    (void)out; (void)fd; (void)adr; (void)len; (void)offset;
+    return VPX_IO_ERR;
+}
+
+uint32_t async_collect(uint32_t ticket, uint8_t wait){
+    (void)ticket; (void)wait;
+    return VPX_IO_ERR;
+}
+
+void async_release(const uint8_t* mem_ptr){
+    (void)mem_ptr;
+}
+#endif
@@ -0,0 +1,213 @@
+//[[ CHANNELS ]]
+//Message channels between VMs (--many clones, harts). A channel is a bounded lock-free
+//MPMC ring in host memory, every slot carries a sequence number so senders and receivers
+//only ever race on one counter each (one CAS per message, uncontended for SPSC use).
+//Sending copies the payload out of the sender's memory into a slot, receiving copies it
+//straight into the receiver's, nothing else touches it.
+//A send to a full or a receive from an empty channel parks the VM (VPX_PEND_CHAN_*),
+//the --many scheduler runs the other VMs in the meantime, a lone VM or hart sleeps
+//until the other side moves. Nothing locks unless somebody sleeps.
+//Channels are numbered, the first hostcall 28 naming one creates it, they live until exit.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define VPX_CHANS 64
+#define VPX_CHAN_MSG_MAX (1u << 20)
+#define VPX_CHAN_SLOTS_MAX 65536
+#define VPX_CHAN_AGAIN 0xFFFFFFFEu //Full (send) or empty (receive), try later.
+#define VPX_CHAN_SPIN 64 //Retries before a blocked VM goes to sleep
+
+typedef struct {
+    uint32_t seq; //Position it's free for sending (pos) or holds a message for receiving (pos + 1)
+    uint32_t len;
+    uint8_t data[];
+} vpx_chan_slot;
+
+typedef struct {
+    uint8_t* slots;
+    uint32_t count; //Power of two
+    uint32_t msg_max;
+    uint32_t stride; //Bytes per slot
+    uint32_t head __attribute__((aligned(64))); //Next position to receive
+    uint32_t tail __attribute__((aligned(64))); //Next position to send
+    uint32_t waiters __attribute__((aligned(64))); //VMs sleeping in chan_wait
+} vpx_chan;
+
+vpx_chan* chans[VPX_CHANS];
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+pthread_mutex_t chan_lock = PTHREAD_MUTEX_INITIALIZER; //Creation and sleeping only, never sends or receives.
+pthread_cond_t chan_moved = PTHREAD_COND_INITIALIZER;
+#endif
+
+static vpx_chan_slot* chan_slot(vpx_chan* c, uint32_t pos){
+    return (vpx_chan_slot*)(c->slots + (size_t)(pos & (c->count - 1)) * c->stride);
+}
+
+static vpx_chan* chan_get(uint32_t id){
+    return id < VPX_CHANS ? __atomic_load_n(&chans[id], __ATOMIC_ACQUIRE) : NULL;
+}
+
+uint32_t chan_open(uint32_t id, uint32_t msg_max, uint32_t slots){
+    //Creates channel id, or checks an existing one has the same shape. Returns 0.
+    if(id >= VPX_CHANS || msg_max == 0 || msg_max > VPX_CHAN_MSG_MAX
+        || slots == 0 || slots > VPX_CHAN_SLOTS_MAX || (slots & (slots - 1)) != 0){
+        errno = EINVAL;
+        return VPX_IO_ERR;
+    }
+    #ifndef _WIN32
+    pthread_mutex_lock(&chan_lock);
+    #endif
+    uint32_t rt = 0;
+    vpx_chan* c = chans[id];
+    if(c != NULL){
+        if(c->msg_max != msg_max || c->count != slots){
+            errno = EEXIST;
+            rt = VPX_IO_ERR;
+        }
+    }else{
+        c = aligned_alloc(64, sizeof(vpx_chan));
+        uint32_t stride = (sizeof(vpx_chan_slot) + msg_max + 7) & ~7u;
+        uint8_t* mem = c != NULL ? malloc((size_t)stride * slots) : NULL;
+        if(mem == NULL){
+            free(c);
+            errno = ENOMEM;
+            rt = VPX_IO_ERR;
+        }else{
+            memset(c, 0, sizeof(*c));
+            c->slots = mem;
+            c->count = slots;
+            c->msg_max = msg_max;
+            c->stride = stride;
+            for(uint32_t i = 0; i < slots; i++){
+                chan_slot(c, i)->seq = i;
+            }
+            __atomic_store_n(&chans[id], c, __ATOMIC_RELEASE);
+        }
+    }
+    #ifndef _WIN32
+    pthread_mutex_unlock(&chan_lock);
+    #endif
+    return rt;
+}
+
+static void chan_wake(vpx_chan* c){
+    //Something moved, wake sleepers if there are any. Free when nobody sleeps.
+    #ifndef _WIN32
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //Pairs with the one in chan_transfer_wait.
+    if(__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST) != 0){
+        pthread_mutex_lock(&chan_lock);
+        pthread_cond_broadcast(&chan_moved);
+        pthread_mutex_unlock(&chan_lock);
+    }
+    #else
+    (void)c;
+    #endif
+}
+
+uint32_t chan_send(uint32_t id, uint32_t adr, uint32_t len){
+    //Returns len, VPX_CHAN_AGAIN if the channel is full.
+    vpx_chan* c = chan_get(id);
+    const uint8_t* src = vpx2_mem_host(adr, len, 0);
+    if(c == NULL || src == VPXNULL || len > c->msg_max){
+        errno = c == NULL ? EBADF : src == VPXNULL ? EFAULT : EMSGSIZE;
+        return VPX_IO_ERR;
+    }
+    uint32_t pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+    vpx_chan_slot* slot;
+    while(1){
+        slot = chan_slot(c, pos);
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&c->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        }else if(diff < 0){
+            return VPX_CHAN_AGAIN; //Receivers haven't freed it yet.
+        }else{
+            pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED); //Another sender took it.
+        }
+    }
+    slot->len = len;
+    memcpy(slot->data, src, len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    chan_wake(c);
+    return len;
+}
+
+uint32_t chan_recv(uint32_t id, uint32_t adr, uint32_t cap){
+    //Returns the message length, only the first cap bytes are copied.
+    //VPX_CHAN_AGAIN if the channel is empty.
+    vpx_chan* c = chan_get(id);
+    uint8_t* dst = vpx2_mem_host(adr, cap, 1);
+    if(c == NULL || dst == VPXNULL){
+        errno = c == NULL ? EBADF : EFAULT;
+        return VPX_IO_ERR;
+    }
+    uint32_t pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+    vpx_chan_slot* slot;
+    while(1){
+        slot = chan_slot(c, pos);
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&c->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        }else if(diff < 0){
+            return VPX_CHAN_AGAIN;
+        }else{
+            pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+        }
+    }
+    uint32_t len = slot->len;
+    memcpy(dst, slot->data, len < cap ? len : cap);
+    __atomic_store_n(&slot->seq, pos + c->count, __ATOMIC_RELEASE);
+    chan_wake(c);
+    return len;
+}
+
+uint32_t chan_transfer(uint8_t send, uint32_t id, uint32_t adr, uint32_t len){
+    return send ? chan_send(id, adr, len) : chan_recv(id, adr, len);
+}
+
+uint32_t chan_transfer_wait(uint8_t send, uint32_t id, uint32_t adr, uint32_t len){
+    //Sends or receives, sleeping while the channel is full or empty.
+    uint32_t rt = chan_transfer(send, id, adr, len);
+    vpx_chan* c = chan_get(id);
+    #ifndef _WIN32
+    for(uint32_t spin = 0; spin < VPX_CHAN_SPIN && rt == VPX_CHAN_AGAIN; spin++){
+        //The other side is usually running on another core and about to move, sleeping costs more.
+        sched_yield();
+        rt = chan_transfer(send, id, adr, len);
+    }
+    while(rt == VPX_CHAN_AGAIN){
+        //Registered as a waiter before the retry, so the other side either
+        //sees us in chan_wake or we see what it did. No lost wakeups.
+        pthread_mutex_lock(&chan_lock);
+        __atomic_add_fetch(&c->waiters, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        rt = chan_transfer(send, id, adr, len);
+        if(rt == VPX_CHAN_AGAIN){
+            pthread_cond_wait(&chan_moved, &chan_lock);
+        }
+        __atomic_sub_fetch(&c->waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&chan_lock);
+        if(rt == VPX_CHAN_AGAIN){
+            rt = chan_transfer(send, id, adr, len);
+        }
+    }
+    #else
+    (void)c;
+    while(rt == VPX_CHAN_AGAIN){
+        struct timespec ts = {0, 100000};
+        nanosleep(&ts, NULL);
+        rt = chan_transfer(send, id, adr, len);
+    }
+    #endif
+    return rt;
+}
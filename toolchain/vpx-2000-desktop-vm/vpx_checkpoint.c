@@ -0,0 +1,442 @@
+//[[ CHECKPOINTS ]]
+//Incremental checkpoints of a long running guest into an append-only file.
+//Needs VPX_DIRTY, the dirty map says which pages changed since the last checkpoint.
+//
+//The interpreter is only paused to copy dirty pages into a staging buffer,
+//a background thread does the actual file writes. A pause copies at most
+//ckpt_max_pages pages. If more are dirty the checkpoint is spread over
+//several pauses (pages copied early and written again get copied again later),
+//a checkpoint only counts once its commit entry (the register file) is in the file.
+//If it hasn't caught up after VPX_CKPT_MAX_ROUNDS pauses the guest is throttled instead
+//of pausing longer: checkpoint_slice halves the blocks it runs between pauses every
+//round, until it dirties fewer pages than a pause copies.
+//
+//File layout (host endianness):
+//  vpx_ckpt_file_header
+//  entries: vpx_ckpt_entry followed by
+//      VPX_CKPT_PAGE:   VPX_PAGE_SIZE bytes of page data, page index in arg
+//      VPX_CKPT_COMMIT: vpx_ckpt_commit, checkpoint number in arg
+#if defined(VPX_DIRTY) && !defined(_WIN32)
+#ifndef VPX_CHECKPOINTS
+#define VPX_CHECKPOINTS
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void stream_wait_all(); //vpx_stream.c
+
+#define VPX_CKPT_MAGIC "VPXC"
+#define VPX_CKPT_VERSION 3
+
+#define VPX_CKPT_PAGE 1
+#define VPX_CKPT_COMMIT 2
+
+#define VPX_CKPT_MAX_ROUNDS 8 //Partial pauses before the guest gets throttled.
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t mem_size;
+    uint32_t page_size;
+} vpx_ckpt_file_header;
+
+typedef struct {
+    uint32_t type;
+    uint32_t arg;
+} vpx_ckpt_entry;
+
+typedef struct {
+    uint32_t registers[64];
+    uint8_t err_code;
+    uint32_t err_val;
+    uint32_t err_pc_state;
+    uint32_t ivt; //VPX_TRAPS state, 0 otherwise.
+    uint32_t timer_period;
+    uint32_t timer_left;
+    uint32_t ctx_base; //VPX_ISA_CONTEXTS state, 0 otherwise.
+    uint32_t ctx_count;
+    uint32_t ctx_current;
+} vpx_ckpt_commit;
+
+typedef struct vpx_ckpt_buf {
+    struct vpx_ckpt_buf* next;
+    size_t len;
+    uint8_t commit; //Ends with a commit entry, sync after writing.
+    uint8_t data[];
+} vpx_ckpt_buf;
+
+//[[ SETTINGS ]]
+uint32_t ckpt_interval_ms = 1000;  //Minimum time between checkpoints.
+uint32_t ckpt_max_pages = 1024;    //Pages copied per pause (4 MiB, around a millisecond).
+uint32_t ckpt_duty = 100;          //Next checkpoint waits at least pause time * duty, so pauses stay under 1%.
+size_t ckpt_max_queued = 256u << 20; //Don't start a checkpoint while this much is still waiting for the disk.
+
+//[[ STATE ]]
+int ckpt_fd = -1;
+uint32_t ckpt_seq = 0;
+uint8_t ckpt_active = 0;   //A checkpoint is being spread over several pauses.
+uint32_t ckpt_rounds = 0;
+uint64_t ckpt_next_due = 0; //Monotonic ns, guarded by ckpt_lock.
+uint8_t ckpt_due = 0; //Set by the writer thread once ckpt_next_due passed, so polling is a single load.
+
+pthread_t ckpt_thread;
+pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ckpt_cond; //Uses CLOCK_MONOTONIC, set up in checkpoint_open.
+vpx_ckpt_buf* ckpt_head = NULL;
+vpx_ckpt_buf* ckpt_tail = NULL;
+size_t ckpt_queued = 0;
+uint8_t ckpt_stop = 0;
+uint8_t ckpt_failed = 0; //A write failed, nothing more goes into the file.
+off_t ckpt_committed = 0; //File length up to the last commit written, writer thread only.
+
+static inline uint64_t ckpt_now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint8_t ckpt_write_all(int fd, const uint8_t* data, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, data, len);
+        if(n <= 0){return 1;}
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void* ckpt_writer(void* arg){
+    //Background thread, drains the queue into the file.
+    (void)arg;
+    pthread_mutex_lock(&ckpt_lock);
+    while(1){
+        while(ckpt_head == NULL && !ckpt_stop){
+            //Idle, doubles as the checkpoint timer.
+            uint64_t now = ckpt_now_ns();
+            if(now >= ckpt_next_due){
+                __atomic_store_n(&ckpt_due, 1, __ATOMIC_RELAXED);
+                pthread_cond_wait(&ckpt_cond, &ckpt_lock);
+            }else{
+                struct timespec ts;
+                ts.tv_sec = ckpt_next_due / 1000000000u;
+                ts.tv_nsec = ckpt_next_due % 1000000000u;
+                pthread_cond_timedwait(&ckpt_cond, &ckpt_lock, &ts);
+            }
+        }
+        if(ckpt_head == NULL){break;} //Stopped and drained.
+        vpx_ckpt_buf* buf = ckpt_head;
+        ckpt_head = buf->next;
+        if(ckpt_head == NULL){ckpt_tail = NULL;}
+        pthread_mutex_unlock(&ckpt_lock);
+
+        //After a failure everything queued is dropped, a commit written after lost
+        //pages would claim a checkpoint the file doesn't have.
+        uint8_t fail = __atomic_load_n(&ckpt_failed, __ATOMIC_RELAXED);
+        if(!fail){
+            fail = ckpt_write_all(ckpt_fd, buf->data, buf->len) != 0;
+            if(!fail && buf->commit){
+                fail = fdatasync(ckpt_fd) != 0; //Checkpoint is only worth something once it's on disk.
+                if(!fail){
+                    ckpt_committed = lseek(ckpt_fd, 0, SEEK_CUR);
+                }
+            }
+            if(fail){
+                //Pages of the unfinished checkpoint go too, a resumed run appending
+                //to the file would have them count for its first commit.
+                if(ftruncate(ckpt_fd, ckpt_committed) != 0){
+                    //Stays torn, restore skips a torn tail anyway.
+                }
+                fprintf(stderr, "checkpoint write failed, no more checkpoints\n");
+                __atomic_store_n(&ckpt_failed, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        pthread_mutex_lock(&ckpt_lock);
+        ckpt_queued -= buf->len;
+        free(buf);
+    }
+    pthread_mutex_unlock(&ckpt_lock);
+    return NULL;
+}
+
+uint8_t checkpoint_open(const char* path){
+    //Starts checkpointing the loaded VM into path (created or appended to).
+    //The first checkpoint contains every page.
+    ckpt_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if(ckpt_fd < 0){
+        return 1;
+    }
+    //A fresh file gets a header. An existing file (resuming from it) has to be for
+    //the same memory size, new checkpoints simply go after the old ones.
+    vpx_ckpt_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VPX_CKPT_MAGIC, 4);
+    hdr.version = VPX_CKPT_VERSION;
+    hdr.mem_size = vpx2_mem_size;
+    hdr.page_size = VPX_PAGE_SIZE;
+    if(lseek(ckpt_fd, 0, SEEK_END) == 0){
+        if(ckpt_write_all(ckpt_fd, (uint8_t*)&hdr, sizeof(hdr)) != 0){
+            close(ckpt_fd);
+            return 1;
+        }
+    }else{
+        vpx_ckpt_file_header old;
+        if(pread(ckpt_fd, &old, sizeof(old), 0) != sizeof(old) || memcmp(&old, &hdr, sizeof(hdr)) != 0){
+            close(ckpt_fd);
+            return 1;
+        }
+    }
+    ckpt_committed = lseek(ckpt_fd, 0, SEEK_END);
+    memset(vpx2_dirty_map, 1, VPX_DIRTY_PAGES(vpx2_mem_size));
+    ckpt_next_due = ckpt_now_ns() + (uint64_t)ckpt_interval_ms * 1000000u;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ckpt_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if(pthread_create(&ckpt_thread, NULL, ckpt_writer, NULL) != 0){
+        close(ckpt_fd);
+        return 1;
+    }
+    return 0;
+}
+
+static void ckpt_enqueue(vpx_ckpt_buf* buf){
+    pthread_mutex_lock(&ckpt_lock);
+    buf->next = NULL;
+    if(ckpt_tail){ckpt_tail->next = buf;}else{ckpt_head = buf;}
+    ckpt_tail = buf;
+    ckpt_queued += buf->len;
+    pthread_cond_signal(&ckpt_cond);
+    pthread_mutex_unlock(&ckpt_lock);
+}
+
+void checkpoint_poll(){
+    //Called while the VM is paused (after vpx2_start returns).
+    //Just a load when no checkpoint is due.
+    if(!ckpt_active){
+        if(!__atomic_load_n(&ckpt_due, __ATOMIC_RELAXED) || __atomic_load_n(&ckpt_failed, __ATOMIC_RELAXED)){return;}
+        pthread_mutex_lock(&ckpt_lock);
+        size_t queued = ckpt_queued;
+        if(queued <= ckpt_max_queued){
+            __atomic_store_n(&ckpt_due, 0, __ATOMIC_RELAXED);
+            ckpt_next_due = UINT64_MAX; //Timer is off until this one commits.
+        }
+        pthread_mutex_unlock(&ckpt_lock);
+        if(queued > ckpt_max_queued){return;} //Disk is behind, try again next pause.
+        stream_wait_all(); //The first checkpoint copies every page, only waits once.
+        ckpt_active = 1;
+        ckpt_rounds = 0;
+    }
+    uint64_t start = ckpt_now_ns();
+    ckpt_rounds++;
+
+    uint32_t bytes = vpx2_mem_bytes(vpx2_mem_size);
+    uint32_t pages = VPX_DIRTY_PAGES(vpx2_mem_size);
+    uint32_t limit = ckpt_max_pages;
+
+    //Count first so the buffer is allocated once.
+    uint32_t dirty = 0;
+    for(uint32_t p = 0; p < pages; p++){
+        dirty += vpx2_dirty_map[p];
+    }
+    uint32_t take = dirty < limit ? dirty : limit;
+    uint8_t commit = take == dirty;
+
+    size_t len = (size_t)take * (sizeof(vpx_ckpt_entry) + VPX_PAGE_SIZE);
+    if(commit){len += sizeof(vpx_ckpt_entry) + sizeof(vpx_ckpt_commit);}
+    vpx_ckpt_buf* buf = malloc(sizeof(vpx_ckpt_buf) + len);
+    if(buf == NULL){
+        ckpt_active = 0; //Try again later, the dirty map is untouched.
+        return;
+    }
+    buf->len = len;
+    buf->commit = commit;
+
+    uint8_t* out = buf->data;
+    uint32_t copied = 0;
+    for(uint32_t p = 0; p < pages && copied < take; p++){
+        if(!vpx2_dirty_map[p]){continue;}
+        vpx_ckpt_entry e = {VPX_CKPT_PAGE, p};
+        memcpy(out, &e, sizeof(e));
+        out += sizeof(e);
+        uint32_t off = p << VPX_PAGE_SHIFT;
+        uint32_t n = 0;
+        if(off < bytes){
+            n = bytes - off < VPX_PAGE_SIZE ? bytes - off : VPX_PAGE_SIZE;
+            memcpy(out, vpx2_mem_ptr + off, n);
+        }
+        memset(out + n, 0, VPX_PAGE_SIZE - n);
+        out += VPX_PAGE_SIZE;
+        vpx2_dirty_map[p] = 0;
+        copied++;
+    }
+    if(commit){
+        vpx_ckpt_entry e = {VPX_CKPT_COMMIT, ckpt_seq++};
+        memcpy(out, &e, sizeof(e));
+        out += sizeof(e);
+        vpx_ckpt_commit c;
+        memset(&c, 0, sizeof(c));
+        memcpy(c.registers, vpx2_registers, sizeof(c.registers));
+        c.err_code = vpx2_err_code;
+        c.err_val = vpx2_err_val;
+        c.err_pc_state = vpx2_err_pc_state;
+        #ifdef VPX_TRAPS
+        c.ivt = vpx2_ivt;
+        c.timer_period = vpx2_timer_period;
+        c.timer_left = vpx2_timer_left;
+        #endif
+        #ifdef VPX_ISA_CONTEXTS
+        c.ctx_base = vpx2_ctx_base;
+        c.ctx_count = vpx2_ctx_count;
+        c.ctx_current = vpx2_ctx_current;
+        #endif
+        memcpy(out, &c, sizeof(c));
+    }
+    ckpt_enqueue(buf);
+
+    if(commit){
+        uint64_t end = ckpt_now_ns();
+        uint64_t wait = (uint64_t)ckpt_interval_ms * 1000000u;
+        uint64_t throttle = (end - start) * ckpt_duty;
+        pthread_mutex_lock(&ckpt_lock);
+        ckpt_next_due = end + (wait > throttle ? wait : throttle);
+        pthread_cond_signal(&ckpt_cond);
+        pthread_mutex_unlock(&ckpt_lock);
+        ckpt_active = 0;
+    }
+}
+
+uint32_t checkpoint_slice(uint32_t slice){
+    //Blocks to run before the next pause.
+    if(!ckpt_active || ckpt_rounds < VPX_CKPT_MAX_ROUNDS){
+        return slice;
+    }
+    uint32_t shift = ckpt_rounds - VPX_CKPT_MAX_ROUNDS + 1;
+    slice = shift < 32 ? slice >> shift : 0;
+    return slice != 0 ? slice : 1;
+}
+
+uint8_t checkpoint_close(){
+    //Flushes everything queued and stops the writer. Returns 1 if a write failed.
+    pthread_mutex_lock(&ckpt_lock);
+    ckpt_stop = 1;
+    pthread_cond_signal(&ckpt_cond);
+    pthread_mutex_unlock(&ckpt_lock);
+    pthread_join(ckpt_thread, NULL);
+    close(ckpt_fd);
+    ckpt_fd = -1;
+    return ckpt_failed;
+}
+
+uint8_t* checkpoint_restore(const char* path){
+    //Rebuilds the VM from the last complete checkpoint in path and loads it.
+    //Returns the guest memory (malloc'd) or NULL on failure.
+    FILE* file = fopen(path, "rb");
+    if(file == NULL){
+        return NULL;
+    }
+    vpx_ckpt_file_header hdr;
+    if(fread(&hdr, 1, sizeof(hdr), file) != sizeof(hdr)
+        || memcmp(hdr.magic, VPX_CKPT_MAGIC, 4) != 0
+        || hdr.version != VPX_CKPT_VERSION
+        || hdr.page_size != VPX_PAGE_SIZE
+        || hdr.mem_size == 0){
+        fclose(file);
+        return NULL;
+    }
+    struct stat fs;
+    if(fstat(fileno(file), &fs) != 0){
+        fclose(file);
+        return NULL;
+    }
+    uint32_t pages = VPX_DIRTY_PAGES(hdr.mem_size);
+    uint8_t* mem_ptr = calloc(1, (size_t)pages << VPX_PAGE_SHIFT); //Whole pages, simpler than clamping.
+    //Pages of the checkpoint being read, only applied once its commit shows up.
+    long* pending = malloc(sizeof(long) * pages);
+    uint32_t* pending_idx = malloc(sizeof(uint32_t) * pages);
+    if(mem_ptr == NULL || pending == NULL || pending_idx == NULL){
+        free(mem_ptr); free(pending); free(pending_idx);
+        fclose(file);
+        return NULL;
+    }
+    memset(pending, 0xff, sizeof(long) * pages); //-1, no pending copy
+    uint32_t pending_count = 0;
+
+    vpx_ckpt_commit last;
+    memset(&last, 0, sizeof(last));
+    uint8_t found = 0;
+    uint8_t broken = 0; //Failed halfway through applying a checkpoint.
+    uint8_t page[VPX_PAGE_SIZE];
+    vpx_ckpt_entry e;
+    while(fread(&e, 1, sizeof(e), file) == sizeof(e)){
+        if(e.type == VPX_CKPT_PAGE){
+            if(e.arg >= pages){break;}
+            long at = ftell(file);
+            if(at < 0 || at + VPX_PAGE_SIZE > fs.st_size){break;} //Torn page, its commit never made it.
+            if(pending[e.arg] < 0){pending_idx[pending_count++] = e.arg;}
+            pending[e.arg] = at; //Later copy of the same page wins.
+            if(fseek(file, VPX_PAGE_SIZE, SEEK_CUR) != 0){break;}
+        }else if(e.type == VPX_CKPT_COMMIT){
+            vpx_ckpt_commit c;
+            if(fread(&c, 1, sizeof(c), file) != sizeof(c)){break;} //Torn commit, ignore.
+            long resume = ftell(file);
+            //Every page is known to be in the file. A read failing now is an I/O error,
+            //memory would be half this checkpoint and half the last so the restore fails.
+            for(uint32_t i = 0; i < pending_count; i++){
+                uint32_t p = pending_idx[i];
+                if(fseek(file, pending[p], SEEK_SET) != 0 || fread(page, 1, VPX_PAGE_SIZE, file) != VPX_PAGE_SIZE){
+                    broken = 1;
+                    break;
+                }
+                memcpy(mem_ptr + ((size_t)p << VPX_PAGE_SHIFT), page, VPX_PAGE_SIZE);
+                pending[p] = -1;
+            }
+            if(broken){break;}
+            pending_count = 0;
+            fseek(file, resume, SEEK_SET);
+            last = c;
+            found = 1;
+        }else{
+            break; //Garbage from a torn write.
+        }
+    }
+    fclose(file);
+    free(pending);
+    free(pending_idx);
+    if(!found || broken){
+        free(mem_ptr);
+        return NULL;
+    }
+
+    vpx2_state st;
+    memcpy(st.registers, last.registers, sizeof(st.registers));
+    st.mem_ptr = mem_ptr;
+    st.mem_size = hdr.mem_size;
+    st.err_code = last.err_code;
+    st.err_val = last.err_val;
+    st.err_pc_state = last.err_pc_state;
+    #ifdef VPX_TRAPS
+    st.ivt = last.ivt;
+    st.timer_period = last.timer_period;
+    st.timer_left = last.timer_left;
+    #endif
+    #ifdef VPX_ISA_CONTEXTS
+    st.ctx_base = last.ctx_base;
+    st.ctx_count = last.ctx_count;
+    st.ctx_current = last.ctx_current;
+    #endif
+    vpx2_state_load(&st);
+    return mem_ptr;
+}
+
+#endif
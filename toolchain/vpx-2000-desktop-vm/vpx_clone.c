@@ -0,0 +1,74 @@
+//[[ CLONING ]]
+//Fork-server style VMs. A template keeps a warmed VM's memory in a memfd,
+//every clone maps that memfd MAP_PRIVATE, so making a clone is a register
+//file copy plus page table setup, guest memory is only copied page by page
+//when a clone writes to it.
+//Linux only (memfd_create).
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+
+void stream_wait_all(); //vpx_stream.c
+void async_release(const uint8_t* mem_ptr); //vpx_async.c
+void files_release(const uint8_t* mem_ptr); //vpx_files.c
+
+typedef struct {
+    int fd;             //memfd holding the template memory
+    uint32_t mem_bytes; //Mapped size (mem_size + tail pad in masked mode)
+    vpx2_state state;   //Registers and error state, state.mem_ptr is unused
+} vpx_template;
+
+uint8_t template_create(vpx_template* tpl){
+    //Turns the currently loaded VM into a template. Returns 0 on success.
+    stream_wait_all(); //Clones never see the rest of a streamed image otherwise.
+    vpx2_state_save(&tpl->state);
+    tpl->mem_bytes = vpx2_mem_bytes(tpl->state.mem_size);
+
+    tpl->fd = memfd_create("vpx2-template", MFD_CLOEXEC);
+    if(tpl->fd < 0){
+        return 1;
+    }
+    if(ftruncate(tpl->fd, tpl->mem_bytes) != 0){
+        close(tpl->fd);
+        return 1;
+    }
+    void* map = mmap(NULL, tpl->mem_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, tpl->fd, 0);
+    if(map == MAP_FAILED){
+        close(tpl->fd);
+        return 1;
+    }
+    memcpy(map, tpl->state.mem_ptr, tpl->mem_bytes); //Only copy ever made of the guest memory.
+    munmap(map, tpl->mem_bytes);
+
+    tpl->state.mem_ptr = VPXNULL;
+    return 0;
+}
+
+void template_destroy(vpx_template* tpl){
+    //Clones that are still alive keep working, their mappings hold the memfd.
+    close(tpl->fd);
+    tpl->fd = -1;
+}
+
+uint8_t clone_create(const vpx_template* tpl, vpx2_state* st){
+    //Fills st with a fresh clone of the template, load it with vpx2_state_load.
+    void* map = mmap(NULL, tpl->mem_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, tpl->fd, 0);
+    if(map == MAP_FAILED){
+        return 1;
+    }
+    *st = tpl->state;
+    st->mem_ptr = map;
+    return 0;
+}
+
+void clone_destroy(vpx2_state* st){
+    async_release(st->mem_ptr); //Reads still in flight would land in the unmapped memory.
+    files_release(st->mem_ptr);
+    munmap(st->mem_ptr, vpx2_mem_bytes(st->mem_size));
+    st->mem_ptr = VPXNULL;
+}
+
+#endif
@@ -0,0 +1,55 @@
+//[[ CONSOLE ]]
+//Guest text output. Everything goes through one host buffer that is written to
+//stdout when a write contains a newline, when it fills up and at exit, so a log
+//line costs one VM exit instead of one per character.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define VPX_CONSOLE_BUF (64 * 1024)
+
+char console_buf[VPX_CONSOLE_BUF];
+uint32_t console_len = 0;
+
+void console_flush(){
+    if(console_len == 0){
+        return;
+    }
+    fwrite(console_buf, 1, console_len, stdout);
+    fflush(stdout);
+    console_len = 0;
+}
+
+void console_write(const char* text, uint32_t len){
+    if(len >= VPX_CONSOLE_BUF){
+        //Too big to buffer, goes out as is.
+        console_flush();
+        fwrite(text, 1, len, stdout);
+        fflush(stdout);
+        return;
+    }
+    if(console_len + len > VPX_CONSOLE_BUF){
+        console_flush();
+    }
+    memcpy(console_buf + console_len, text, len);
+    console_len += len;
+    if(memchr(text, '\n', len) != NULL){
+        console_flush();
+    }
+}
+
+void console_put(char c){
+    console_write(&c, 1);
+}
+
+void console_int(uint32_t val, uint8_t format){
+    //format: 0 unsigned decimal, 1 signed decimal, 2 hex (0x prefix, no padding)
+    char text[16];
+    int len;
+    switch(format){
+        default: len = snprintf(text, sizeof(text), "%u", val); break;
+        case 1: len = snprintf(text, sizeof(text), "%d", (int32_t)val); break;
+        case 2: len = snprintf(text, sizeof(text), "0x%x", val); break;
+    }
+    console_write(text, len);
+}
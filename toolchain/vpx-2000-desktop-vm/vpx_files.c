@@ -0,0 +1,256 @@
+//[[ FILE WINDOWS ]]
+//Host files given on the command line (--in / --out) can be mapped into guest
+//memory, the guest then reads and writes them like any other memory.
+//  input  windows: MAP_PRIVATE, guest writes never reach the file
+//  output windows: MAP_SHARED, the file grows to cover the window and is
+//                  cut to its final size by files_close at exit
+//A window starts on a page aligned guest address and a page aligned file offset.
+//Files larger than the guest address space are walked by remapping the same
+//window at increasing offsets.
+//If guest memory isn't mmap backed at that address (plain calloc) the window is
+//copied in instead, output windows are then written back on remap and at exit.
+//Files are shared by every VM (pipeline stages), copy mode windows belong to the memory
+//they were copied into.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define VPX_FILES_MAX 16
+#define VPX_FILE_PAGE 4096
+#define VPX_FILE_ERR 0xFFFFFFFFu //Returned in r60 when a window can't be mapped.
+#define VPX_FILE_KEEP UINT64_MAX
+
+typedef struct {
+    const char* path;
+    uint8_t out;        //Opened for writing
+    int fd;
+    uint64_t size;      //Current file size
+    uint64_t final_size;//Output only, what the file is cut to at exit (VPX_FILE_KEEP: leave it)
+} vpx_file;
+
+typedef struct {
+    uint8_t used;
+    uint8_t file;       //Index into files_out
+    uint8_t* mem;       //vpx2_mem_ptr of the VM it's in
+    uint32_t addr;
+    uint32_t len;
+    uint64_t offset;
+} vpx_copy_window;
+
+vpx_file files_in[VPX_FILES_MAX];
+vpx_file files_out[VPX_FILES_MAX];
+uint8_t files_in_count = 0;
+uint8_t files_out_count = 0;
+vpx_copy_window files_copies[VPX_FILES_MAX]; //Output windows in copy mode
+
+uint8_t files_add(const char* path, uint8_t out){
+    //Registers --in / --out, opened lazily on first map. Returns 0 on success.
+    vpx_file* list = out ? files_out : files_in;
+    uint8_t* count = out ? &files_out_count : &files_in_count;
+    if(*count >= VPX_FILES_MAX){
+        return 1;
+    }
+    vpx_file* f = &list[(*count)++];
+    f->path = path;
+    f->out = out;
+    f->fd = -1;
+    f->size = 0;
+    f->final_size = VPX_FILE_KEEP;
+    return 0;
+}
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint8_t files_open(vpx_file* f){
+    if(f->fd >= 0){
+        return 0;
+    }
+    f->fd = f->out ? open(f->path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(f->path, O_RDONLY);
+    if(f->fd < 0){
+        printf("failed to open file: %s \n", f->path);
+        return 1;
+    }
+    struct stat st;
+    if(fstat(f->fd, &st) != 0){
+        return 1;
+    }
+    f->size = st.st_size;
+    return 0;
+}
+
+static uint8_t files_copy_out(const vpx_copy_window* w){
+    //Writes a copy mode output window back to its file.
+    const uint8_t* src = w->mem + w->addr;
+    uint32_t done = 0;
+    while(done < w->len){
+        ssize_t n = pwrite(files_out[w->file].fd, src + done, w->len - done, w->offset + done);
+        if(n <= 0){return 1;}
+        done += n;
+    }
+    return 0;
+}
+
+static void files_drop_copies(uint32_t addr, uint32_t len){
+    //A new window replaces whatever copy mode output windows it overlaps, they're written back first.
+    for(uint8_t i = 0; i < VPX_FILES_MAX; i++){
+        vpx_copy_window* w = &files_copies[i];
+        if(w->used && w->mem == vpx2_mem_ptr && addr < w->addr + w->len && w->addr < addr + len){
+            files_copy_out(w);
+            w->used = 0;
+        }
+    }
+}
+
+static uint8_t files_copy_in(int fd, uint8_t* dst, uint32_t len, uint64_t offset){
+    uint32_t done = 0;
+    while(done < len){
+        ssize_t n = pread(fd, dst + done, len - done, offset + done);
+        if(n <= 0){return 1;}
+        done += n;
+    }
+    return 0;
+}
+
+static uint8_t files_keep_copy(uint8_t file, uint32_t addr, uint32_t len, uint64_t offset){
+    //Remembers a copy mode output window so it gets written back.
+    for(uint8_t i = 0; i < VPX_FILES_MAX; i++){
+        vpx_copy_window* w = &files_copies[i];
+        if(!w->used){
+            w->used = 1;
+            w->file = file;
+            w->mem = vpx2_mem_ptr;
+            w->addr = addr;
+            w->len = len;
+            w->offset = offset;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+uint32_t files_map(uint8_t out, uint32_t index, uint32_t addr, uint32_t len, uint64_t offset){
+    //Maps a window of file index at guest address addr. Input windows are clamped to
+    //the end of the file. Returns the window length or VPX_FILE_ERR.
+    if(index >= (out ? files_out_count : files_in_count)){
+        return VPX_FILE_ERR;
+    }
+    vpx_file* f = out ? &files_out[index] : &files_in[index];
+    if(files_open(f) != 0){
+        return VPX_FILE_ERR;
+    }
+    if(addr % VPX_FILE_PAGE != 0 || offset % VPX_FILE_PAGE != 0 || (uint64_t)addr + len > vpx2_mem_size){
+        return VPX_FILE_ERR;
+    }
+
+    if(!out){
+        if(offset >= f->size){
+            return 0;
+        }
+        if(f->size - offset < len){
+            len = f->size - offset;
+        }
+    }else if(offset + len > f->size){
+        if(ftruncate(f->fd, offset + len) != 0){
+            return VPX_FILE_ERR;
+        }
+        f->size = offset + len;
+    }
+    if(len == 0){
+        return 0;
+    }
+
+    files_drop_copies(addr, len);
+    //Before the mapping: streamed pages have to land first or the reader would write over
+    //the window later, and dirty tracking has to see the window's contents.
+    uint8_t* dst = vpx2_mem_host(addr, len, 1);
+    uint32_t mapped = 0;
+    if((uintptr_t)dst % VPX_FILE_PAGE == 0){
+        //Whole pages, an input's last page is zero past the end of the file.
+        //If that page would stick out of guest memory it's copied instead.
+        mapped = (uint32_t)(((uint64_t)len + VPX_FILE_PAGE - 1) & ~(uint64_t)(VPX_FILE_PAGE - 1));
+        if((uint64_t)addr + mapped > vpx2_mem_size){
+            mapped = len - len % VPX_FILE_PAGE;
+        }
+        if(mapped != 0){
+            void* map = mmap(dst, mapped, PROT_READ | PROT_WRITE, (out ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED, f->fd, offset);
+            if(map == MAP_FAILED){
+                return VPX_FILE_ERR;
+            }
+        }
+        if(mapped >= len){
+            return len;
+        }
+    }
+
+    //[[ COPY MODE ]]
+    if(files_copy_in(f->fd, dst + mapped, len - mapped, offset + mapped) != 0){
+        return VPX_FILE_ERR;
+    }
+    if(out && files_keep_copy(index, addr + mapped, len - mapped, offset + mapped) != 0){
+        return VPX_FILE_ERR;
+    }
+    return len;
+}
+
+uint8_t files_set_size(uint32_t index, uint64_t size){
+    //Final size of an output file, otherwise it ends with the last byte any window covered.
+    if(index >= files_out_count){
+        return 1;
+    }
+    files_out[index].final_size = size;
+    return 0;
+}
+
+void files_release(const uint8_t* mem_ptr){
+    //Writes back the copy mode windows of a VM whose memory is about to go away.
+    for(uint8_t i = 0; i < VPX_FILES_MAX; i++){
+        if(files_copies[i].used && files_copies[i].mem == mem_ptr){
+            files_copy_out(&files_copies[i]);
+            files_copies[i].used = 0;
+        }
+    }
+}
+
+void files_close(){
+    //Flushes the outputs, the guest is done with them.
+    for(uint8_t i = 0; i < VPX_FILES_MAX; i++){
+        if(files_copies[i].used){
+            files_copy_out(&files_copies[i]);
+            files_copies[i].used = 0;
+        }
+    }
+    for(uint8_t i = 0; i < files_out_count; i++){
+        vpx_file* f = &files_out[i];
+        if(f->fd < 0){continue;}
+        //Shared mappings are already in the page cache, the kernel writes them out.
+        if(f->final_size != VPX_FILE_KEEP && ftruncate(f->fd, f->final_size) != 0){
+            printf("failed to resize output file: %s \n", f->path);
+        }
+        close(f->fd);
+        f->fd = -1;
+    }
+}
+
+#else
+uint32_t files_map(uint8_t out, uint32_t index, uint32_t addr, uint32_t len, uint64_t offset){
+    (void)out; (void)index; (void)addr; (void)len; (void)offset;
+    printf("file windows are not supported on windows\n");
+    return VPX_FILE_ERR;
+}
+
+uint8_t files_set_size(uint32_t index, uint64_t size){
+    (void)index; (void)size;
+    return 1;
+}
+
+void files_release(const uint8_t* mem_ptr){
+    (void)mem_ptr;
+}
+
+void files_close(){
+}
+#endif
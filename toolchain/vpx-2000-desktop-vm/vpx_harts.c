@@ -0,0 +1,164 @@
+//[[ HARTS ]]
+//Extra guest hardware threads (VPX_HARTS). Hostcall 26 starts a hart at an entry PC with
+//its own stack, it runs on a new host thread over the same guest memory until it does
+//hostcall 0. Hostcall 27 waits for a hart and returns its exit code, parking like any
+//other pending hostcall.
+//Host state (console, files, rings...) isn't thread safe, so hostcalls from all harts
+//run one at a time. Hart 0 is the one main started, when it exits the process ends
+//and every other hart with it.
+#include <stdint.h>
+#include <errno.h>
+
+#define VPX_HARTS_MAX 64
+
+int32_t run_vm();
+
+uint8_t harts_enabled = 0; //Plain runs only, --many/--clones/--reuse/--snapshot/--checkpoint assume one hart.
+
+#if defined(VPX_HARTS) && !defined(_WIN32)
+#include <pthread.h>
+
+#define VPX_HART_FREE 0
+#define VPX_HART_RUNNING 1
+#define VPX_HART_DONE 2
+
+typedef struct {
+    uint8_t state;
+    int32_t code; //Exit code once done, -1 on error
+    uint32_t entry;
+    uint32_t stack;
+    uint32_t arg;
+    uint8_t* mem_ptr; //The starting hart's memory, VM memory is thread local too.
+    uint32_t mem_size;
+    #ifdef VPX_DIRTY
+    uint8_t* dirty_map;
+    #endif
+} vpx_hart;
+
+vpx_hart harts[VPX_HARTS_MAX]; //harts[0] is main's, never in the table
+pthread_mutex_t harts_hostcall_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t harts_lock = PTHREAD_MUTEX_INITIALIZER; //Guards harts[]
+pthread_cond_t harts_done = PTHREAD_COND_INITIALIZER;
+VPX_HART_LOCAL uint32_t harts_hostcall_depth = 0; //Hostcalls of a guest function called from a hostcall nest.
+
+void harts_lock_hostcalls(){
+    //Only with harts on, hostcall 2 runs --many/--clones/--reuse from inside a hostcall.
+    if(harts_enabled && harts_hostcall_depth++ == 0){
+        pthread_mutex_lock(&harts_hostcall_lock);
+    }
+}
+
+void harts_unlock_hostcalls(){
+    if(harts_enabled && --harts_hostcall_depth == 0){
+        pthread_mutex_unlock(&harts_hostcall_lock);
+    }
+}
+
+static void* hart_main(void* arg){
+    //Registers are thread local and start zeroed.
+    vpx_hart* h = arg;
+    vpx2_init(h->mem_ptr, h->mem_size);
+    #ifdef VPX_DIRTY
+    vpx2_dirty_map = h->dirty_map;
+    #endif
+    vpx2_wreg(VPX_RPC, h->entry);
+    vpx2_wreg(VPX_RSP, h->stack);
+    vpx2_wreg(60, h->arg);
+    int32_t code = run_vm();
+
+    pthread_mutex_lock(&harts_lock);
+    h->code = code;
+    h->state = VPX_HART_DONE;
+    pthread_cond_broadcast(&harts_done);
+    pthread_mutex_unlock(&harts_lock);
+    return NULL;
+}
+
+uint32_t hart_start(uint32_t entry, uint32_t stack, uint32_t arg){
+    //Returns the hart id.
+    if(!harts_enabled){
+        errno = ENOSYS;
+        return VPX_IO_ERR;
+    }
+    pthread_mutex_lock(&harts_lock);
+    uint32_t id = 1;
+    while(id < VPX_HARTS_MAX && harts[id].state != VPX_HART_FREE){
+        id++;
+    }
+    if(id == VPX_HARTS_MAX){
+        pthread_mutex_unlock(&harts_lock);
+        errno = EAGAIN; //Join some first.
+        return VPX_IO_ERR;
+    }
+    vpx_hart* h = &harts[id];
+    h->state = VPX_HART_RUNNING;
+    h->entry = entry;
+    h->stack = stack;
+    h->arg = arg;
+    h->mem_ptr = vpx2_mem_ptr;
+    h->mem_size = vpx2_mem_size;
+    #ifdef VPX_DIRTY
+    h->dirty_map = vpx2_dirty_map;
+    #endif
+    pthread_mutex_unlock(&harts_lock);
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, hart_main, h) != 0){
+        pthread_mutex_lock(&harts_lock); //Other harts may be looking for a free slot.
+        h->state = VPX_HART_FREE;
+        pthread_mutex_unlock(&harts_lock);
+        errno = EAGAIN;
+        return VPX_IO_ERR;
+    }
+    pthread_detach(thread);
+    return id;
+}
+
+uint8_t hart_collect(uint32_t id, uint8_t wait, uint32_t* code){
+    //Exit code of a hart into code (VPX_IO_ERR if it failed or id isn't a started hart),
+    //returns 1 while it's still running and wait is 0. A collected hart's id is free again.
+    if(id == 0 || id >= VPX_HARTS_MAX){
+        errno = EINVAL;
+        *code = VPX_IO_ERR;
+        return 0;
+    }
+    vpx_hart* h = &harts[id];
+    pthread_mutex_lock(&harts_lock);
+    while(wait && h->state == VPX_HART_RUNNING){
+        pthread_cond_wait(&harts_done, &harts_lock);
+    }
+    uint8_t running = 0;
+    if(h->state == VPX_HART_FREE){
+        errno = EINVAL;
+        *code = VPX_IO_ERR;
+    }else if(h->state == VPX_HART_RUNNING){
+        running = 1;
+    }else{
+        if(h->code < 0){
+            errno = ECHILD; //Stopped on an error.
+        }
+        *code = h->code < 0 ? VPX_IO_ERR : (uint32_t)h->code;
+        h->state = VPX_HART_FREE;
+    }
+    pthread_mutex_unlock(&harts_lock);
+    return running;
+}
+
+#else
+void harts_lock_hostcalls(){}
+void harts_unlock_hostcalls(){}
+
+uint32_t hart_start(uint32_t entry, uint32_t stack, uint32_t arg){
+    //Not built with VPX_HARTS (or no threads here).
+    (void)entry; (void)stack; (void)arg;
+    errno = ENOSYS;
+    return VPX_IO_ERR;
+}
+
+uint8_t hart_collect(uint32_t id, uint8_t wait, uint32_t* code){
+    (void)id; (void)wait;
+    errno = EINVAL;
+    *code = VPX_IO_ERR;
+    return 0;
+}
+#endif
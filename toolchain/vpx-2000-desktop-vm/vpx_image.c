@@ -0,0 +1,381 @@
+//[[ IMAGES ]]
+//Sectioned container format for .vpx files. Raw memory dumps still load as before,
+//a container is recognized by its magic.
+//
+//Layout (little endian):
+//  vpx_image_header
+//  vpx_image_section[section_count]
+//  section data, anywhere in the file
+//
+//Sections are copied (or mapped, when both the file offset and the guest
+//address are page aligned) to their guest address, whatever is past file_size
+//up to mem_size is zero. Guest memory starts out as anonymous zero pages, so
+//bss and the stack cost nothing until the guest touches them.
+//
+//Sections flagged VPX_SECF_LZ hold vpx_lz_section data instead of raw bytes:
+//  vpx_lz_section, uint32 chunk_end[chunk_count], compressed chunks
+//Every chunk is an independent vpx_lz block of chunk_size bytes (the last
+//one may be shorter), so any chunk can be decoded on its own and the loader
+//streams them straight into guest memory without buffering the section.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define VPX_IMG_MAGIC "VPX2"
+#define VPX_IMG_VERSION 1
+#define VPX_IMG_PAGE 4096
+
+//== section types ==
+#define VPX_SEC_CODE 1
+#define VPX_SEC_RODATA 2
+#define VPX_SEC_DATA 3
+#define VPX_SEC_BSS 4    //No file data, only mem_size.
+#define VPX_SEC_SYMTAB 5 //Not loaded, entries of {uint32 addr, uint32 name_len, name}.
+
+//== section flags ==
+#define VPX_SECF_LZ 1 //Compressed with vpx_lz, see above.
+
+#define VPX_LZ_CHUNK (256 * 1024) //Chunk size used by image_pack.
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t section_count;
+    uint32_t mem_size;     //Total guest memory
+    uint32_t entry_pc;     //Initial RPC
+    uint32_t initial_rsp;  //Initial RSP, the stack grows up from here
+    uint32_t stack_size;
+    uint32_t isa_required; //vpx2_cpu_id bits the image needs (VPX_CPUID_ISA_*)
+    uint32_t flags;        //Reserved, 0
+} vpx_image_header;
+
+typedef struct {
+    uint32_t type;
+    uint32_t flags;       //VPX_SECF_*
+    uint32_t file_offset;
+    uint32_t file_size;
+    uint32_t addr;        //Guest address
+    uint32_t mem_size;    //Bytes in guest memory, file_size or more
+} vpx_image_section;
+
+typedef struct {
+    uint32_t raw_size;    //Decompressed size, at most the section's mem_size
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+} vpx_lz_section;
+
+//Symbol table of the loaded image, if it had one.
+uint8_t* image_symtab = NULL;
+uint32_t image_symtab_size = 0;
+
+static uint8_t image_read_at(FILE* file, uint32_t offset, void* dst, uint32_t len){
+    if(fseek(file, offset, SEEK_SET) != 0){return 1;}
+    return fread(dst, 1, len, file) != len;
+}
+
+uint8_t image_find_symbol(const char* name, uint32_t* addr){
+    //Looks a name up in the symbol table. Returns 0 and sets addr when found.
+    size_t name_len = strlen(name);
+    uint32_t pos = 0;
+    while(pos + 8 <= image_symtab_size){
+        uint32_t sym_addr, len;
+        memcpy(&sym_addr, image_symtab + pos, 4);
+        memcpy(&len, image_symtab + pos + 4, 4);
+        pos += 8;
+        if(len > image_symtab_size - pos){break;}
+        if(len == name_len && memcmp(image_symtab + pos, name, len) == 0){
+            *addr = sym_addr;
+            return 0;
+        }
+        pos += len;
+    }
+    return 1;
+}
+
+uint8_t image_lz_chunk(FILE* file, const vpx_image_section* sec, const vpx_lz_section* lz,
+    const uint32_t* chunk_end, uint32_t idx, uint8_t* buf, uint8_t* dst){
+    //Decodes chunk idx of a compressed section into dst (chunk_size bytes, less for the last one).
+    //buf is scratch space of VPX_LZ_BOUND(chunk_size) bytes. Returns 0 on success.
+    uint32_t table = sizeof(vpx_lz_section) + lz->chunk_count * 4;
+    uint32_t start = idx == 0 ? 0 : chunk_end[idx - 1];
+    uint32_t end = chunk_end[idx];
+    if(end < start || end - start > VPX_LZ_BOUND(lz->chunk_size) || (uint64_t)table + end > sec->file_size){
+        return 1;
+    }
+    uint32_t raw_off = idx * lz->chunk_size;
+    uint32_t raw_len = lz->raw_size - raw_off < lz->chunk_size ? lz->raw_size - raw_off : lz->chunk_size;
+    if(image_read_at(file, sec->file_offset + table + start, buf, end - start) != 0){
+        return 1;
+    }
+    return lz_decompress(buf, end - start, dst, raw_len);
+}
+
+static uint8_t image_load_lz(FILE* file, const vpx_image_section* sec, uint8_t* dst){
+    //Streams a compressed section into guest memory chunk by chunk.
+    vpx_lz_section lz;
+    if(sec->file_size < sizeof(lz) || image_read_at(file, sec->file_offset, &lz, sizeof(lz)) != 0){
+        return 1;
+    }
+    if(lz.raw_size > sec->mem_size || lz.chunk_size == 0 || lz.chunk_size > (64u << 20)
+        || lz.chunk_count != (uint32_t)(((uint64_t)lz.raw_size + lz.chunk_size - 1) / lz.chunk_size)
+        || (uint64_t)lz.chunk_count * 4 > sec->file_size){
+        return 1;
+    }
+    uint32_t* chunk_end = malloc((size_t)lz.chunk_count * 4 + 4);
+    uint8_t* buf = malloc(VPX_LZ_BOUND(lz.chunk_size));
+    uint8_t fail = chunk_end == NULL || buf == NULL
+        || image_read_at(file, sec->file_offset + sizeof(lz), chunk_end, lz.chunk_count * 4) != 0;
+    for(uint32_t i = 0; i < lz.chunk_count && !fail; i++){
+        fail = image_lz_chunk(file, sec, &lz, chunk_end, i, buf, dst + (size_t)i * lz.chunk_size);
+    }
+    free(chunk_end);
+    free(buf);
+    return fail;
+}
+
+static uint8_t* image_alloc(uint32_t bytes){
+    //Zeroed guest memory, lazily backed where the OS allows it.
+    #ifdef _WIN32
+    return calloc(1, bytes);
+    #else
+    void* map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return map == MAP_FAILED ? NULL : map;
+    #endif
+}
+
+static void image_release(uint8_t* mem_ptr, uint32_t bytes){
+    #ifdef _WIN32
+    (void)bytes;
+    free(mem_ptr);
+    #else
+    munmap(mem_ptr, bytes);
+    #endif
+}
+
+uint8_t image_check_header(const vpx_image_header* hdr){
+    //Validates a header against this build. Returns 0 if the image can run.
+    if(memcmp(hdr->magic, VPX_IMG_MAGIC, 4) != 0){
+        printf("not a vpx image\n");
+        return 1;
+    }
+    if(hdr->version != VPX_IMG_VERSION){
+        printf("unsupported image version: %hu\n", hdr->version);
+        return 1;
+    }
+    if((hdr->isa_required & ~vpx2_cpu_id) != 0){
+        printf("image needs ISA extensions this build lacks: 0x%x (have 0x%x)\n", hdr->isa_required, vpx2_cpu_id);
+        return 1;
+    }
+    if(hdr->mem_size == 0 || hdr->entry_pc >= hdr->mem_size
+        || (uint64_t)hdr->initial_rsp + hdr->stack_size > hdr->mem_size){
+        printf("bad image layout\n");
+        return 1;
+    }
+    return 0;
+}
+
+uint8_t image_check_section(const vpx_image_header* hdr, const vpx_image_section* sec){
+    //Checks a loadable section fits the image. Returns 0 if fine.
+    return (!(sec->flags & VPX_SECF_LZ) && sec->file_size > sec->mem_size)
+        || (uint64_t)sec->addr + sec->mem_size > hdr->mem_size
+        || (sec->type == VPX_SEC_BSS && sec->file_size != 0);
+}
+
+static uint8_t image_load_sections(FILE* file, const vpx_image_header* hdr, const vpx_image_section* secs, uint8_t* mem_ptr){
+    //Copies (or maps) every section into mem_ptr. Returns 0 on success.
+    //Section data past the end of the file fails here, a mapping of it would only SIGBUS later.
+    if(fseek(file, 0, SEEK_END) != 0){
+        return 1;
+    }
+    uint64_t file_len = ftell(file);
+    for(uint16_t i = 0; i < hdr->section_count; i++){
+        const vpx_image_section* sec = &secs[i];
+        if((uint64_t)sec->file_offset + sec->file_size > file_len){
+            printf("image section %hu runs past the end of the file\n", i);
+            return 1;
+        }
+        if(sec->type == VPX_SEC_SYMTAB){
+            free(image_symtab);
+            image_symtab = malloc(sec->file_size ? sec->file_size : 1);
+            image_symtab_size = sec->file_size;
+            if(image_symtab == NULL || image_read_at(file, sec->file_offset, image_symtab, sec->file_size) != 0){
+                printf("failed to read symbol table\n");
+                return 1;
+            }
+            continue;
+        }
+        if(image_check_section(hdr, sec) != 0){
+            printf("bad image section %hu\n", i);
+            return 1;
+        }
+        if(sec->file_size == 0){continue;} //bss, already zero.
+        if(sec->flags & VPX_SECF_LZ){
+            if(image_load_lz(file, sec, mem_ptr + sec->addr) != 0){
+                printf("bad compressed image section %hu\n", i);
+                return 1;
+            }
+            continue;
+        }
+
+        uint32_t len = sec->file_size;
+        uint8_t* dst = mem_ptr + sec->addr;
+        #ifndef _WIN32
+        //Page aligned on both sides: map the whole pages straight from the file,
+        //copy only the partial tail page (its rest has to stay zero).
+        if(sec->addr % VPX_IMG_PAGE == 0 && sec->file_offset % VPX_IMG_PAGE == 0){
+            uint32_t whole = len - len % VPX_IMG_PAGE;
+            if(whole != 0){
+                void* map = mmap(dst, whole, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(file), sec->file_offset);
+                if(map == MAP_FAILED){
+                    printf("failed to map image section %hu\n", i);
+                    return 1;
+                }
+            }
+            dst += whole;
+            len -= whole;
+            if(len != 0 && image_read_at(file, sec->file_offset + whole, dst, len) != 0){
+                printf("failed to read image section %hu\n", i);
+                return 1;
+            }
+            continue;
+        }
+        #endif
+        if(image_read_at(file, sec->file_offset, dst, len) != 0){
+            printf("failed to read image section %hu\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint8_t image_load(FILE* file){
+    //Loads a container image and initializes the VM with it. Returns 0 on success.
+    vpx_image_header hdr;
+    if(image_read_at(file, 0, &hdr, sizeof(hdr)) != 0 || image_check_header(&hdr) != 0){
+        return 1;
+    }
+
+    vpx_image_section* secs = malloc(sizeof(vpx_image_section) * (hdr.section_count + 1));
+    if(secs == NULL || image_read_at(file, sizeof(hdr), secs, sizeof(vpx_image_section) * hdr.section_count) != 0){
+        printf("failed to read image sections\n");
+        free(secs);
+        return 1;
+    }
+
+    #ifdef VPX_MASKED
+    uint32_t mem_size = vpx2_mem_pow2(hdr.mem_size);
+    if(mem_size == 0){
+        printf("image too large for masked mode: %u Bytes\n", hdr.mem_size);
+        free(secs);
+        return 1;
+    }
+    #else
+    uint32_t mem_size = hdr.mem_size;
+    #endif
+    uint32_t mem_bytes = vpx2_mem_bytes(mem_size);
+    uint8_t* mem_ptr = image_alloc(mem_bytes);
+    if(mem_ptr == NULL){
+        printf("failed to allocate memory for image: %u Bytes\n", mem_bytes);
+        free(secs);
+        return 1;
+    }
+
+    uint8_t fail = image_load_sections(file, &hdr, secs, mem_ptr);
+    free(secs);
+    if(fail){
+        image_release(mem_ptr, mem_bytes); //Also drops the section mappings.
+        return 1;
+    }
+
+    vpx2_init(mem_ptr, mem_size);
+    vpx2_wreg(VPX_RPC, hdr.entry_pc);
+    vpx2_wreg(VPX_RSP, hdr.initial_rsp);
+    return 0;
+}
+
+uint8_t image_pack(const char* raw_path, const char* out_path, uint8_t compress){
+    //Wraps a raw memory dump into a container: one code section at 0,
+    //entry at 0 and a 64 KiB stack right after the image.
+    //With compress the section is stored in VPX_LZ_CHUNK sized vpx_lz chunks.
+    FILE* in = fopen(raw_path, "rb");
+    if(in == NULL){
+        printf("failed to open file: %s \n", raw_path);
+        return 1;
+    }
+    fseek(in, 0, SEEK_END);
+    uint32_t raw_size = ftell(in);
+    rewind(in);
+    uint8_t* raw = malloc(raw_size ? raw_size : 1);
+    if(raw == NULL || fread(raw, 1, raw_size, in) != raw_size){
+        printf("failed to read file: %s \n", raw_path);
+        free(raw);
+        fclose(in);
+        return 1;
+    }
+    fclose(in);
+
+    vpx_image_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VPX_IMG_MAGIC, 4);
+    hdr.version = VPX_IMG_VERSION;
+    hdr.section_count = 1;
+    hdr.entry_pc = 0;
+    hdr.initial_rsp = (raw_size + 15) & ~15u;
+    hdr.stack_size = 64 * 1024;
+    hdr.mem_size = hdr.initial_rsp + hdr.stack_size;
+
+    vpx_image_section sec;
+    memset(&sec, 0, sizeof(sec));
+    sec.type = VPX_SEC_CODE;
+    sec.file_offset = VPX_IMG_PAGE; //Page aligned so the loader can map it.
+    sec.file_size = raw_size;
+    sec.addr = 0;
+    sec.mem_size = raw_size;
+
+    uint8_t* data = raw;
+    if(compress){
+        uint32_t count = (raw_size + VPX_LZ_CHUNK - 1) / VPX_LZ_CHUNK;
+        uint32_t table = sizeof(vpx_lz_section) + count * 4;
+        data = malloc(table + (size_t)count * VPX_LZ_BOUND(VPX_LZ_CHUNK));
+        if(data == NULL){
+            printf("failed to allocate compression buffer\n");
+            free(raw);
+            return 1;
+        }
+        vpx_lz_section lz = {raw_size, VPX_LZ_CHUNK, count};
+        memcpy(data, &lz, sizeof(lz));
+        uint32_t end = 0;
+        for(uint32_t i = 0; i < count; i++){
+            uint32_t off = i * VPX_LZ_CHUNK;
+            uint32_t len = raw_size - off < VPX_LZ_CHUNK ? raw_size - off : VPX_LZ_CHUNK;
+            end += lz_compress(raw + off, len, data + table + end);
+            memcpy(data + sizeof(lz) + i * 4, &end, 4);
+        }
+        sec.flags = VPX_SECF_LZ;
+        sec.file_size = table + end;
+    }
+
+    uint8_t head[VPX_IMG_PAGE];
+    memset(head, 0, sizeof(head));
+    memcpy(head, &hdr, sizeof(hdr));
+    memcpy(head + sizeof(hdr), &sec, sizeof(sec));
+
+    FILE* out = fopen(out_path, "wb");
+    if(out == NULL){
+        printf("failed to open file: %s \n", out_path);
+        free(raw);
+        return 1;
+    }
+    uint8_t fail = fwrite(head, 1, sizeof(head), out) != sizeof(head)
+        || fwrite(data, 1, sec.file_size, out) != sec.file_size;
+    if(fclose(out) != 0){fail = 1;}
+    if(data != raw){free(data);}
+    free(raw);
+    return fail;
+}
@@ -0,0 +1,239 @@
+//[[ FILE I/O ]]
+//open/read/write/pread/close hostcalls. Buffers are guest pointers, the syscall
+//runs directly on guest memory (vpx2_mem_host) after one bounds check, nothing
+//is copied through the host.
+//Guest fds index io_fds, 0 1 2 are the host's stdin, stdout and stderr.
+//Opening files needs --root <dir>, paths are relative to it and can't contain ".."
+//or go through symlinks.
+//Batches go through readv/writev: the guest passes an array of {ptr, len} pairs.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define VPX_IO_FDS 64
+#define VPX_IO_IOV 64 //Max pairs per readv/writev hostcall
+#define VPX_IO_PATH 1024
+#define VPX_IO_ERR 0xFFFFFFFFu //Result on failure, errno goes to r59.
+
+//Open modes
+#define VPX_IO_READ 0
+#define VPX_IO_WRITE 1 //Create or truncate
+#define VPX_IO_APPEND 2 //Create, writes go to the end
+#define VPX_IO_RDWR 3 //Create, keep contents
+
+const char* io_root_path = NULL; //--root <dir>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+int io_fds[VPX_IO_FDS] = {0, 1, 2};
+uint8_t io_fds_ready = 0;
+int io_root = -1;
+
+static void io_init(){
+    if(io_fds_ready){return;}
+    for(uint32_t i = 3; i < VPX_IO_FDS; i++){
+        io_fds[i] = -1;
+    }
+    io_fds_ready = 1;
+}
+
+static int io_fd(uint32_t fd){
+    //Host fd for a guest fd, -1 if it isn't open.
+    io_init();
+    return fd < VPX_IO_FDS ? io_fds[fd] : -1;
+}
+
+static uint8_t io_path_ok(const char* path){
+    //Relative, no ".." component.
+    if(path[0] == '/' || path[0] == 0){
+        return 0;
+    }
+    for(const char* p = path; *p; ){
+        if(p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == 0)){
+            return 0;
+        }
+        const char* slash = strchr(p, '/');
+        if(slash == NULL){break;}
+        p = slash + 1;
+    }
+    return 1;
+}
+
+static int io_parent(char* path, char** leaf){
+    //Opens the directory holding the last component of path, walking it one component at
+    //a time with O_NOFOLLOW, O_NOFOLLOW on the whole path only covers the last one.
+    //Returns the directory fd (io_root for a plain name) or -1, leaf gets the last component.
+    int dir = io_root;
+    char* p = path;
+    char* slash;
+    while((slash = strchr(p, '/')) != NULL){
+        *slash = 0;
+        if(p[0] != 0){ //"a//b"
+            int next = openat(dir, p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if(dir != io_root){
+                close(dir);
+            }
+            if(next < 0){
+                return -1; //ELOOP/ENOTDIR for a symlink
+            }
+            dir = next;
+        }
+        p = slash + 1;
+    }
+    *leaf = p;
+    return dir;
+}
+
+uint32_t io_open(uint32_t path_adr, uint32_t path_len, uint32_t mode){
+    //Returns the guest fd.
+    io_init();
+    const uint8_t* src = vpx2_mem_host(path_adr, path_len, 0);
+    if(src == VPXNULL || path_len >= VPX_IO_PATH || io_root_path == NULL){
+        errno = EACCES;
+        return VPX_IO_ERR;
+    }
+    char path[VPX_IO_PATH];
+    memcpy(path, src, path_len);
+    path[path_len] = 0;
+    if(!io_path_ok(path)){
+        errno = EACCES;
+        return VPX_IO_ERR;
+    }
+    if(io_root < 0){
+        io_root = open(io_root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(io_root < 0){return VPX_IO_ERR;}
+    }
+
+    int flags;
+    switch(mode){
+        case VPX_IO_READ: flags = O_RDONLY; break;
+        case VPX_IO_WRITE: flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+        case VPX_IO_APPEND: flags = O_WRONLY | O_CREAT | O_APPEND; break;
+        case VPX_IO_RDWR: flags = O_RDWR | O_CREAT; break;
+        default: errno = EINVAL; return VPX_IO_ERR;
+    }
+    uint32_t fd = 3;
+    while(fd < VPX_IO_FDS && io_fds[fd] >= 0){
+        fd++;
+    }
+    if(fd == VPX_IO_FDS){
+        errno = EMFILE;
+        return VPX_IO_ERR;
+    }
+    char* leaf;
+    int dir = io_parent(path, &leaf);
+    if(dir < 0){
+        return VPX_IO_ERR;
+    }
+    int host_fd = openat(dir, leaf, flags | O_CLOEXEC | O_NOFOLLOW, 0644);
+    if(dir != io_root){
+        int err = errno;
+        close(dir);
+        errno = err;
+    }
+    if(host_fd < 0){
+        return VPX_IO_ERR;
+    }
+    io_fds[fd] = host_fd;
+    return fd;
+}
+
+uint32_t io_close(uint32_t fd){
+    int host_fd = io_fd(fd);
+    if(host_fd < 0){
+        errno = EBADF;
+        return VPX_IO_ERR;
+    }
+    io_fds[fd] = -1;
+    if(fd <= 2){
+        return 0; //The host's standard streams stay open.
+    }
+    return close(host_fd) == 0 ? 0 : VPX_IO_ERR;
+}
+
+uint32_t io_rw(uint8_t out, uint32_t fd, uint32_t adr, uint32_t len, int64_t offset){
+    //read/write, or pread/pwrite when offset isn't negative. Returns the byte count.
+    int host_fd = io_fd(fd);
+    uint8_t* buf = vpx2_mem_host(adr, len, !out);
+    if(host_fd < 0 || buf == VPXNULL){
+        errno = host_fd < 0 ? EBADF : EFAULT;
+        return VPX_IO_ERR;
+    }
+    if(len > 0x7FFFFFFF){
+        len = 0x7FFFFFFF;
+    }
+    ssize_t n;
+    if(offset >= 0){
+        n = out ? pwrite(host_fd, buf, len, offset) : pread(host_fd, buf, len, offset);
+    }else{
+        n = out ? write(host_fd, buf, len) : read(host_fd, buf, len);
+    }
+    return n < 0 ? VPX_IO_ERR : (uint32_t)n;
+}
+
+uint32_t io_rwv(uint8_t out, uint32_t fd, uint32_t iov_adr, uint32_t count){
+    //readv/writev over count {ptr, len} pairs at iov_adr. Returns the total byte count.
+    int host_fd = io_fd(fd);
+    if(host_fd < 0){
+        errno = EBADF;
+        return VPX_IO_ERR;
+    }
+    if(count > VPX_IO_IOV){
+        count = VPX_IO_IOV; //Short transfer, the guest resubmits the rest.
+    }
+    const uint8_t* pairs = vpx2_mem_host(iov_adr, count * 8, 0);
+    if(pairs == VPXNULL){
+        errno = EFAULT;
+        return VPX_IO_ERR;
+    }
+    struct iovec iov[VPX_IO_IOV];
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < count; i++){
+        uint32_t adr = vpx2_mem_r32(iov_adr + i * 8);
+        uint32_t len = vpx2_mem_r32(iov_adr + i * 8 + 4);
+        uint8_t* buf = vpx2_mem_host(adr, len, !out);
+        if(buf == VPXNULL || total + len > 0x7FFFFFFF){
+            errno = EFAULT;
+            return VPX_IO_ERR;
+        }
+        iov[i].iov_base = buf;
+        iov[i].iov_len = len;
+        total += len;
+    }
+    ssize_t n = out ? writev(host_fd, iov, count) : readv(host_fd, iov, count);
+    return n < 0 ? VPX_IO_ERR : (uint32_t)n;
+}
+
+uint32_t io_errno(){
+    return errno;
+}
+
+#else
+uint32_t io_open(uint32_t path_adr, uint32_t path_len, uint32_t mode){
+    (void)path_adr; (void)path_len; (void)mode;
+    return VPX_IO_ERR;
+}
+
+uint32_t io_close(uint32_t fd){
+    (void)fd;
+    return VPX_IO_ERR;
+}
+
+uint32_t io_rw(uint8_t out, uint32_t fd, uint32_t adr, uint32_t len, int64_t offset){
+    (void)out; (void)fd; (void)adr; (void)len; (void)offset;
+    return VPX_IO_ERR;
+}
+
+uint32_t io_rwv(uint8_t out, uint32_t fd, uint32_t iov_adr, uint32_t count){
+    (void)out; (void)fd; (void)iov_adr; (void)count;
+    return VPX_IO_ERR;
+}
+
+uint32_t io_errno(){
+    return 38; //ENOSYS
+}
+#endif
@@ -0,0 +1,166 @@
+//[[ LZ CODEC ]]
+//Small LZ77 block codec in the LZ4 block style, used for compressed image sections.
+//No external dependency, decoding is mostly memcpy so it runs at memory speed.
+//
+//A block is a list of sequences:
+//  token (literal length << 4 | (match length - 4))
+//  [literal length extension bytes, 255 = keep adding]
+//  literals
+//  match offset (2 bytes, little endian, 1..65535 back)
+//  [match length extension bytes]
+//The last sequence only has literals.
+#include <stdint.h>
+#include <string.h>
+
+#define VPX_LZ_MIN_MATCH 4
+#define VPX_LZ_HASH_BITS 12
+#define VPX_LZ_BOUND(n) ((n) + (n) / 255 + 16) //Worst case compressed size.
+
+static inline uint32_t lz_hash(uint32_t v){
+    return (v * 2654435761u) >> (32 - VPX_LZ_HASH_BITS);
+}
+
+static inline uint8_t* lz_put_length(uint8_t* op, uint32_t len){
+    while(len >= 255){
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+uint32_t lz_compress(const uint8_t* src, uint32_t src_len, uint8_t* dst){
+    //Greedy compressor, dst needs VPX_LZ_BOUND(src_len) bytes. Returns the compressed size.
+    uint32_t table[1 << VPX_LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    uint8_t* op = dst;
+    uint32_t anchor = 0; //Start of pending literals
+    uint32_t ip = 0;
+    //Matches stop 12 bytes before the end and the last 5 bytes are always literals (same rule as LZ4).
+    uint32_t limit = src_len > 12 ? src_len - 12 : 0;
+
+    while(ip < limit){
+        uint32_t seq;
+        memcpy(&seq, src + ip, 4);
+        uint32_t h = lz_hash(seq);
+        uint32_t ref = table[h];
+        table[h] = ip;
+
+        uint32_t cand;
+        memcpy(&cand, src + ref, 4);
+        if(ref >= ip || ip - ref > 65535 || cand != seq){
+            ip++;
+            continue;
+        }
+
+        //Extend the match.
+        uint32_t match_end = ip + VPX_LZ_MIN_MATCH;
+        uint32_t max_end = src_len - 5;
+        while(match_end < max_end && src[match_end] == src[ref + (match_end - ip)]){
+            match_end++;
+        }
+
+        uint32_t lit_len = ip - anchor;
+        uint32_t match_len = match_end - ip - VPX_LZ_MIN_MATCH;
+        uint8_t* token = op++;
+        *token = (uint8_t)(((lit_len >= 15 ? 15 : lit_len) << 4) | (match_len >= 15 ? 15 : match_len));
+        if(lit_len >= 15){op = lz_put_length(op, lit_len - 15);}
+        memcpy(op, src + anchor, lit_len);
+        op += lit_len;
+        uint16_t off = (uint16_t)(ip - ref);
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        if(match_len >= 15){op = lz_put_length(op, match_len - 15);}
+
+        ip = match_end;
+        anchor = ip;
+    }
+
+    //Trailing literals.
+    uint32_t lit_len = src_len - anchor;
+    *op++ = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if(lit_len >= 15){op = lz_put_length(op, lit_len - 15);}
+    memcpy(op, src + anchor, lit_len);
+    op += lit_len;
+
+    return (uint32_t)(op - dst);
+}
+
+uint8_t lz_decompress(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_len){
+    //Decodes a block into exactly dst_len bytes. Input is untrusted, every
+    //length is checked. Returns 0 on success.
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + src_len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_len;
+
+    while(ip < iend){
+        uint8_t token = *ip++;
+
+        //[[ LITERALS ]]
+        uint32_t lit_len = token >> 4;
+        if(lit_len == 15){
+            uint8_t b;
+            do{
+                if(ip >= iend){return 1;}
+                b = *ip++;
+                lit_len += b;
+            }while(b == 255);
+        }
+        if(lit_len > (uint32_t)(iend - ip) || lit_len > (uint32_t)(oend - op)){return 1;}
+        if(lit_len <= 16 && iend - ip >= 16 && oend - op >= 16){
+            memcpy(op, ip, 16); //Fixed size copy, the extra bytes get overwritten later.
+        }else{
+            memcpy(op, ip, lit_len);
+        }
+        ip += lit_len;
+        op += lit_len;
+
+        if(ip == iend){break;} //Last sequence.
+
+        //[[ MATCH ]]
+        if(iend - ip < 2){return 1;}
+        uint32_t off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(off == 0 || off > (uint32_t)(op - dst)){return 1;}
+        uint32_t match_len = token & 15;
+        if(match_len == 15){
+            uint8_t b;
+            do{
+                if(ip >= iend){return 1;}
+                b = *ip++;
+                match_len += b;
+            }while(b == 255);
+        }
+        match_len += VPX_LZ_MIN_MATCH;
+        if(match_len > (uint32_t)(oend - op)){return 1;}
+
+        const uint8_t* ref = op - off;
+        if(off >= 16 && (uint32_t)(oend - op) >= match_len + 16){
+            //Copies in 16 byte steps, may write up to 15 bytes past the match (still inside dst).
+            uint8_t* end = op + match_len;
+            do{
+                memcpy(op, ref, 16);
+                op += 16;
+                ref += 16;
+            }while(op < end);
+            op = end;
+        }else if(off >= 8 && (uint32_t)(oend - op) >= match_len + 8){
+            uint8_t* end = op + match_len;
+            do{
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            }while(op < end);
+            op = end;
+        }else{
+            //Overlapping (runs) or close to the end.
+            for(uint32_t i = 0; i < match_len; i++){
+                op[i] = ref[i];
+            }
+            op += match_len;
+        }
+    }
+    return op == oend ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+//[[ PARKING ]]
+//Hostcalls that would block (waiting on an async ticket, sleeping) return
+//HOSTCALL_PENDING and describe what they wait for in hostcall_pending.
+//A lone VM just blocks on it (pending_block). The --many scheduler saves the
+//VM's state instead, runs other VMs and resumes it once pending_try succeeds,
+//so one host thread serves many I/O bound guests.
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#define VPX_PEND_TICKET 1 //Async ticket, result goes to r60 like hostcall 21
+#define VPX_PEND_TIMER 2  //Sleep until deadline_ns
+#define VPX_PEND_HART 3   //Join hart number ticket, exit code goes to r60 like hostcall 27
+#define VPX_PEND_CHAN_SEND 4 //Send {adr, len} on channel number ticket once there's room
+#define VPX_PEND_CHAN_RECV 5 //Receive into {adr, len} from channel number ticket once there's a message
+#define VPX_PEND_PIPE 6 //Get a buffer from pipeline link ticket (VPX_PIPE_IN / OUT) like hostcall 34
+
+typedef struct {
+    uint8_t kind;
+    uint32_t ticket;
+    uint64_t deadline_ns; //CLOCK_MONOTONIC
+    uint32_t adr; //Channel buffer
+    uint32_t len;
+} vpx_pending;
+
+VPX_HART_LOCAL vpx_pending hostcall_pending; //Filled by the hostcall that returned HOSTCALL_PENDING
+
+uint64_t park_now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void park_result(uint32_t rt){
+    vpx2_wreg(60, rt);
+    if(rt == VPX_IO_ERR){
+        vpx2_wreg(59, io_errno());
+    }
+}
+
+static void park_pipe_result(uint32_t rt, uint32_t len){
+    vpx2_wreg(60, rt);
+    vpx2_wreg(59, rt == VPX_IO_ERR ? io_errno() : len);
+}
+
+
+uint8_t pending_try(const vpx_pending* p){
+    //Completes the hostcall if what it waits for is done, the VM has to be loaded.
+    //Returns 1 if it did.
+    if(p->kind == VPX_PEND_TICKET){
+        uint32_t rt = async_collect(p->ticket, 0);
+        if(rt == VPX_ASYNC_PENDING){
+            return 0;
+        }
+        park_result(rt);
+        return 1;
+    }
+    if(p->kind == VPX_PEND_HART){
+        uint32_t code;
+        if(hart_collect(p->ticket, 0, &code) != 0){
+            return 0;
+        }
+        park_result(code);
+        return 1;
+    }
+    if(p->kind == VPX_PEND_CHAN_SEND || p->kind == VPX_PEND_CHAN_RECV){
+        uint32_t rt = chan_transfer(p->kind == VPX_PEND_CHAN_SEND, p->ticket, p->adr, p->len);
+        if(rt == VPX_CHAN_AGAIN){
+            return 0;
+        }
+        park_result(rt);
+        return 1;
+    }
+    if(p->kind == VPX_PEND_PIPE){
+        uint32_t len;
+        uint32_t rt = pipe_get(p->ticket, &len);
+        if(rt == VPX_PIPE_AGAIN){
+            return 0;
+        }
+        park_pipe_result(rt, len);
+        return 1;
+    }
+    if(park_now_ns() < p->deadline_ns){
+        return 0;
+    }
+    vpx2_wreg(60, 0);
+    return 1;
+}
+
+void pending_block(const vpx_pending* p){
+    //Waits right here and completes the hostcall.
+    if(p->kind == VPX_PEND_TICKET){
+        park_result(async_collect(p->ticket, 1));
+        return;
+    }
+    if(p->kind == VPX_PEND_HART){
+        uint32_t code;
+        hart_collect(p->ticket, 1, &code);
+        park_result(code);
+        return;
+    }
+    if(p->kind == VPX_PEND_CHAN_SEND || p->kind == VPX_PEND_CHAN_RECV){
+        park_result(chan_transfer_wait(p->kind == VPX_PEND_CHAN_SEND, p->ticket, p->adr, p->len));
+        return;
+    }
+    if(p->kind == VPX_PEND_PIPE){
+        uint32_t len;
+        uint32_t rt = pipe_get_wait(p->ticket, &len);
+        park_pipe_result(rt, len);
+        return;
+    }
+    uint64_t now = park_now_ns();
+    if(now < p->deadline_ns){
+        uint64_t left = p->deadline_ns - now;
+        struct timespec ts = {left / 1000000000u, left % 1000000000u};
+        while(nanosleep(&ts, &ts) != 0 && errno == EINTR){}
+    }
+    vpx2_wreg(60, 0);
+}
@@ -0,0 +1,297 @@
+//[[ PIPELINE ]]
+//--stage <image> chains VMs into a pipeline: the main image is stage 0, every --stage is
+//the next one. Each stage runs on its own thread, pinned to its own core where there are
+//enough. Neighbouring stages share a link: a ring of opt_pipe_depth buffers of opt_pipe_buf
+//bytes in a memfd, mapped into both guests (hostcall 33). The buffer a producer fills is the
+//one its consumer reads, nothing is copied.
+//Buffers go around the ring with hostcall 34 (get) and 35 (put). A producer that is a whole
+//ring ahead parks in get until the consumer puts buffers back, so a slow stage holds back
+//everything upstream of it.
+//When a stage ends its output link is closed, the next stage's get returns 0 once it has
+//drained it. If the consumer ends first the producer's get fails with EPIPE.
+//Needs VPX_HARTS, every thread keeps its own VM state.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#define VPX_PIPE_STAGES 16
+#define VPX_PIPE_DEPTH_MAX 64
+#define VPX_PIPE_IN 0
+#define VPX_PIPE_OUT 1
+#define VPX_PIPE_AGAIN 0xFFFFFFFEu //Nothing to get yet, try later.
+
+const char* pipe_stage_paths[VPX_PIPE_STAGES]; //--stage, stage 0 (the main image) isn't in here
+uint32_t pipe_stage_count = 0;
+uint32_t opt_pipe_buf = 64 * 1024; //--pipe-buf <bytes>, rounded up to whole pages
+uint32_t opt_pipe_depth = 8; //--pipe-depth <n>, buffers per link
+
+int32_t run_vm();
+uint8_t load_image(const char* path);
+uint8_t vm_prepare();
+
+#if defined(VPX_HARTS) && defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+    int fd; //memfd with the buffers
+    uint32_t buf; //Bytes per buffer, page aligned
+    uint32_t depth;
+    uint32_t head __attribute__((aligned(64))); //Consumer, buffers put back
+    uint32_t tail __attribute__((aligned(64))); //Producer, buffers published
+    uint8_t closed; //Producer has ended
+    uint8_t gone; //Consumer has ended
+    uint32_t waiters;
+    uint32_t lens[VPX_PIPE_DEPTH_MAX];
+} vpx_pipe_link;
+
+vpx_pipe_link pipe_links[VPX_PIPE_STAGES]; //pipe_links[i] goes from stage i to i + 1
+pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER; //Sleeping only
+pthread_cond_t pipe_moved = PTHREAD_COND_INITIALIZER;
+
+//The running stage's view of its links, index VPX_PIPE_IN / VPX_PIPE_OUT.
+VPX_HART_LOCAL vpx_pipe_link* pipe_ends[2];
+VPX_HART_LOCAL uint32_t pipe_addr[2]; //Where the link is mapped in guest memory, 0 if it isn't
+VPX_HART_LOCAL uint32_t pipe_next[2]; //Next buffer this stage gets
+
+static void pipe_wake(vpx_pipe_link* l){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //Pairs with the one in pipe_get_wait.
+    if(__atomic_load_n(&l->waiters, __ATOMIC_SEQ_CST) != 0){
+        pthread_mutex_lock(&pipe_lock);
+        pthread_cond_broadcast(&pipe_moved);
+        pthread_mutex_unlock(&pipe_lock);
+    }
+}
+
+uint32_t pipe_map(uint32_t which, uint32_t addr, uint32_t* buf){
+    //Maps a link at guest address addr. Returns the window size, the buffer size goes to buf.
+    vpx_pipe_link* l = which < 2 ? pipe_ends[which] : NULL;
+    if(l == NULL){
+        errno = EBADF;
+        return VPX_IO_ERR;
+    }
+    uint32_t size = l->buf * l->depth;
+    uint8_t* dst = vpx2_mem_ptr + addr;
+    if(addr == 0 || addr % VPX_PAGE_SIZE != 0 || (uintptr_t)dst % VPX_PAGE_SIZE != 0 || (uint64_t)addr + size > vpx2_mem_size){
+        errno = EINVAL;
+        return VPX_IO_ERR;
+    }
+    if(mmap(dst, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, l->fd, 0) == MAP_FAILED){
+        return VPX_IO_ERR;
+    }
+    vpx2_mem_host(addr, size, 1); //Dirty tracking sees the new contents.
+    pipe_addr[which] = addr;
+    *buf = l->buf;
+    return size;
+}
+
+uint32_t pipe_get(uint32_t which, uint32_t* len){
+    //Input: next filled buffer, its length goes to len. 0 once the producer ended and it's all read.
+    //Output: next free buffer.
+    //Returns its guest address, VPX_PIPE_AGAIN if there isn't one yet.
+    vpx_pipe_link* l = which < 2 ? pipe_ends[which] : NULL;
+    if(l == NULL || pipe_addr[which] == 0){
+        errno = EBADF;
+        return VPX_IO_ERR;
+    }
+    uint32_t next = pipe_next[which];
+    if(which == VPX_PIPE_IN){
+        if(next == __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE)){
+            if(!__atomic_load_n(&l->closed, __ATOMIC_ACQUIRE)){
+                return VPX_PIPE_AGAIN;
+            }
+            if(next == __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE)){
+                *len = 0;
+                return 0; //Published before it closed, so this is really everything.
+            }
+        }
+        *len = l->lens[next % l->depth];
+    }else{
+        if(__atomic_load_n(&l->gone, __ATOMIC_ACQUIRE)){
+            errno = EPIPE;
+            return VPX_IO_ERR;
+        }
+        if(next - __atomic_load_n(&l->head, __ATOMIC_ACQUIRE) >= l->depth){
+            return VPX_PIPE_AGAIN; //Backpressure.
+        }
+        *len = l->buf;
+    }
+    pipe_next[which] = next + 1;
+    return pipe_addr[which] + (next % l->depth) * l->buf;
+}
+
+uint32_t pipe_get_wait(uint32_t which, uint32_t* len){
+    //pipe_get, sleeping while there's nothing to get. Same waiter scheme as the channels.
+    uint32_t rt = pipe_get(which, len);
+    vpx_pipe_link* l = which < 2 ? pipe_ends[which] : NULL;
+    for(uint32_t spin = 0; spin < 64 && rt == VPX_PIPE_AGAIN; spin++){
+        sched_yield();
+        rt = pipe_get(which, len);
+    }
+    while(rt == VPX_PIPE_AGAIN){
+        pthread_mutex_lock(&pipe_lock);
+        __atomic_add_fetch(&l->waiters, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        rt = pipe_get(which, len);
+        if(rt == VPX_PIPE_AGAIN){
+            pthread_cond_wait(&pipe_moved, &pipe_lock);
+        }
+        __atomic_sub_fetch(&l->waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pipe_lock);
+        if(rt == VPX_PIPE_AGAIN){
+            rt = pipe_get(which, len);
+        }
+    }
+    return rt;
+}
+
+uint32_t pipe_put(uint32_t which, uint32_t len){
+    //Input: hands the oldest gotten buffer back. Output: publishes the oldest gotten buffer
+    //with len bytes. Returns 0.
+    vpx_pipe_link* l = which < 2 ? pipe_ends[which] : NULL;
+    if(l == NULL){
+        errno = EBADF;
+        return VPX_IO_ERR;
+    }
+    uint32_t* pos = which == VPX_PIPE_IN ? &l->head : &l->tail;
+    uint32_t at = __atomic_load_n(pos, __ATOMIC_RELAXED); //Only this stage moves it.
+    if(at == pipe_next[which] || (which == VPX_PIPE_OUT && len > l->buf)){
+        errno = at == pipe_next[which] ? EINVAL : EMSGSIZE; //Nothing gotten, or too long.
+        return VPX_IO_ERR;
+    }
+    if(which == VPX_PIPE_OUT){
+        l->lens[at % l->depth] = len;
+    }
+    __atomic_store_n(pos, at + 1, __ATOMIC_RELEASE);
+    pipe_wake(l);
+    return 0;
+}
+
+static void pipe_end(){
+    //The running stage is done, unblock its neighbours.
+    if(pipe_ends[VPX_PIPE_IN] != NULL){
+        __atomic_store_n(&pipe_ends[VPX_PIPE_IN]->gone, 1, __ATOMIC_RELEASE);
+        pipe_wake(pipe_ends[VPX_PIPE_IN]);
+    }
+    if(pipe_ends[VPX_PIPE_OUT] != NULL){
+        __atomic_store_n(&pipe_ends[VPX_PIPE_OUT]->closed, 1, __ATOMIC_RELEASE);
+        pipe_wake(pipe_ends[VPX_PIPE_OUT]);
+    }
+}
+
+static void pipe_enter(uint32_t stage, uint32_t stages){
+    //Binds the calling thread to a stage: its links and a core of its own.
+    pipe_ends[VPX_PIPE_IN] = stage > 0 ? &pipe_links[stage - 1] : NULL;
+    pipe_ends[VPX_PIPE_OUT] = stage + 1 < stages ? &pipe_links[stage] : NULL;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cores > 1){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(stage % cores, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set); //Just a hint, fine if it fails.
+    }
+}
+
+typedef struct {
+    pthread_t thread;
+    uint32_t stage;
+    uint32_t stages;
+    int32_t code;
+} vpx_pipe_stage;
+
+static void* pipe_stage_main(void* arg){
+    vpx_pipe_stage* s = arg;
+    pipe_enter(s->stage, s->stages);
+    s->code = -1;
+    if(load_image(pipe_stage_paths[s->stage - 1]) == 0 && vm_prepare() == 0){
+        s->code = run_vm();
+    }
+    pipe_end();
+    return NULL;
+}
+
+int32_t pipe_run(){
+    //Runs the loaded VM as stage 0 and every --stage after it, returns the last stage's
+    //exit code or -1 if any stage failed.
+    uint32_t stages = pipe_stage_count + 1;
+    uint32_t buf = (opt_pipe_buf + VPX_PAGE_SIZE - 1) & ~(VPX_PAGE_SIZE - 1);
+    if(buf == 0 || opt_pipe_depth == 0 || opt_pipe_depth > VPX_PIPE_DEPTH_MAX || (uint64_t)buf * opt_pipe_depth > 0x40000000){
+        printf("bad --pipe-buf / --pipe-depth\n");
+        return -1;
+    }
+    for(uint32_t i = 0; i < pipe_stage_count; i++){
+        //Streaming state is process wide, only the main image can arrive over a pipe.
+        struct stat st;
+        if(stat(pipe_stage_paths[i], &st) != 0 || !S_ISREG(st.st_mode)){
+            printf("pipeline stage isn't a regular file: %s\n", pipe_stage_paths[i]);
+            return -1;
+        }
+    }
+    stream_wait_all(); //The other stages' memory accesses would check the main image's ready map.
+    for(uint32_t i = 0; i + 1 < stages; i++){
+        vpx_pipe_link* l = &pipe_links[i];
+        l->fd = memfd_create("vpx-pipe", MFD_CLOEXEC);
+        if(l->fd < 0 || ftruncate(l->fd, (off_t)buf * opt_pipe_depth) != 0){
+            printf("failed to create pipeline link %u\n", i);
+            return -1;
+        }
+        l->buf = buf;
+        l->depth = opt_pipe_depth;
+    }
+
+    vpx_pipe_stage threads[VPX_PIPE_STAGES];
+    for(uint32_t i = 1; i < stages; i++){
+        vpx_pipe_stage* s = &threads[i - 1];
+        s->stage = i;
+        s->stages = stages;
+        if(pthread_create(&s->thread, NULL, pipe_stage_main, s) != 0){
+            printf("failed to start stage %u\n", i);
+            return -1;
+        }
+    }
+    pipe_enter(0, stages);
+    int32_t code = run_vm();
+    pipe_end();
+    uint8_t failed = code < 0;
+    for(uint32_t i = 1; i < stages; i++){
+        pthread_join(threads[i - 1].thread, NULL);
+        code = threads[i - 1].code;
+        failed |= code < 0;
+    }
+    return failed ? -1 : code;
+}
+
+#else
+uint32_t pipe_map(uint32_t which, uint32_t addr, uint32_t* buf){
+    //No pipeline in this build.
+    (void)which; (void)addr; (void)buf;
+    errno = EBADF;
+    return VPX_IO_ERR;
+}
+
+uint32_t pipe_get(uint32_t which, uint32_t* len){
+    (void)which; (void)len;
+    errno = EBADF;
+    return VPX_IO_ERR;
+}
+
+uint32_t pipe_get_wait(uint32_t which, uint32_t* len){
+    return pipe_get(which, len);
+}
+
+uint32_t pipe_put(uint32_t which, uint32_t len){
+    (void)which; (void)len;
+    errno = EBADF;
+    return VPX_IO_ERR;
+}
+
+int32_t pipe_run(){
+    printf("--stage needs a linux build with VPX_HARTS\n");
+    return -1;
+}
+#endif
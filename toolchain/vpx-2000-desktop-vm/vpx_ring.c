@@ -0,0 +1,93 @@
+//[[ HOSTCALL RINGS ]]
+//Batched hostcalls. The guest queues requests in a submission ring in its own
+//memory and flushes them with one hostcall, the host runs the whole batch and
+//posts the results to a completion ring. One VM exit per batch instead of per call.
+//
+//Ring layout at ring_addr (entries is a power of two, counters only ever grow):
+//  u32 sq_head   host, next request to run
+//  u32 sq_tail   guest, one past the last queued request
+//  u32 cq_head   guest, next completion to read
+//  u32 cq_tail   host, one past the last posted completion
+//  sqe[entries]  {code, arg, user_data, 0}  code/arg are what r61/r60 would hold
+//  cqe[entries]  {user_data, r60, r59, 0}   registers after the hostcall ran
+//Every hart has its own ring (pipeline stages each have their own memory), a hart sets up
+//the ring it flushes.
+#include <stdint.h>
+
+#define VPX_RING_SQ_HEAD 0
+#define VPX_RING_SQ_TAIL 4
+#define VPX_RING_CQ_HEAD 8
+#define VPX_RING_CQ_TAIL 12
+#define VPX_RING_HDR 16
+#define VPX_RING_ENTRY 16
+#define VPX_RING_MAX 4096
+
+uint8_t execute_hostcall(uint32_t hostcall);
+
+VPX_HART_LOCAL uint32_t ring_addr = 0;
+VPX_HART_LOCAL uint32_t ring_entries = 0; //0: no ring set up
+
+uint8_t ring_setup(uint32_t addr, uint32_t entries){
+    //Returns 0 if the ring fits in guest memory.
+    if(entries == 0 || entries > VPX_RING_MAX || (entries & (entries - 1)) != 0 || addr % 4 != 0){
+        return 1;
+    }
+    if((uint64_t)addr + VPX_RING_HDR + (uint64_t)entries * VPX_RING_ENTRY * 2 > vpx2_mem_size){
+        return 1;
+    }
+    ring_addr = addr;
+    ring_entries = entries;
+    return 0;
+}
+
+uint8_t ring_flush(uint32_t* done){
+    //Runs everything queued while there's room for its completion.
+    //Returns a HOSTCALL_* status, an exit or invalid hostcall in the batch stops it right there.
+    *done = 0;
+    if(ring_entries == 0){
+        return HOSTCALL_INVALID;
+    }
+    uint32_t mask = ring_entries - 1;
+    uint32_t sqes = ring_addr + VPX_RING_HDR;
+    uint32_t cqes = sqes + ring_entries * VPX_RING_ENTRY;
+    uint32_t sq_head = vpx2_mem_r32(ring_addr + VPX_RING_SQ_HEAD);
+    uint32_t sq_tail = vpx2_mem_r32(ring_addr + VPX_RING_SQ_TAIL);
+    uint32_t cq_head = vpx2_mem_r32(ring_addr + VPX_RING_CQ_HEAD);
+    uint32_t cq_tail = vpx2_mem_r32(ring_addr + VPX_RING_CQ_TAIL);
+    uint8_t st = HOSTCALL_OK;
+
+    while(sq_head != sq_tail && cq_tail - cq_head < ring_entries){
+        uint32_t sqe = sqes + (sq_head & mask) * VPX_RING_ENTRY;
+        uint32_t code = vpx2_mem_r32(sqe);
+        uint32_t user_data = vpx2_mem_r32(sqe + 8);
+        if(code == 21 || code == 22 || code == 23 || code == 24 || code == 27 || code == 29 || code == 30 || code == 34){
+            //No rings inside rings, nothing that sleeps (async wait, sleep, joins, channels, pipes)
+            //while other harts' hostcalls wait.
+            st = HOSTCALL_INVALID;
+            break;
+        }
+        vpx2_wreg(60, vpx2_mem_r32(sqe + 4));
+        vpx2_wreg(59, 0);
+        st = execute_hostcall(code);
+        if(st == HOSTCALL_PENDING){
+            pending_block(&hostcall_pending); //Batches run to completion.
+            st = HOSTCALL_OK;
+        }
+        sq_head++;
+        if(st != HOSTCALL_OK){
+            break;
+        }
+
+        uint32_t cqe = cqes + (cq_tail & mask) * VPX_RING_ENTRY;
+        vpx2_mem_w32(cqe, user_data);
+        vpx2_mem_w32(cqe + 4, vpx2_rreg(60));
+        vpx2_mem_w32(cqe + 8, vpx2_rreg(59));
+        vpx2_mem_w32(cqe + 12, 0);
+        cq_tail++;
+        (*done)++;
+    }
+
+    vpx2_mem_w32(ring_addr + VPX_RING_SQ_HEAD, sq_head);
+    vpx2_mem_w32(ring_addr + VPX_RING_CQ_TAIL, cq_tail);
+    return st;
+}
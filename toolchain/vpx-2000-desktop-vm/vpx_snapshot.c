@@ -0,0 +1,164 @@
+//[[ SNAPSHOTS ]]
+//Dumps the whole VM (registers, error state, memory) to a file so a later
+//process can resume from that exact point instead of re-running guest init.
+//
+//Layout (host endianness):
+//  [0, VPX_SNAP_HDR)   vpx_snapshot_header, zero padded
+//  [VPX_SNAP_HDR, ..)  memory image, mem_bytes long
+//The image starts on a page boundary so restore can mmap it MAP_PRIVATE,
+//pages the guest never writes stay shared with the page cache (and with
+//every other process restored from the same file).
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+void stream_wait_all(); //vpx_stream.c
+
+#define VPX_SNAP_MAGIC "VPXS"
+#define VPX_SNAP_VERSION 1
+#define VPX_SNAP_HDR 4096 //Header area, one page so the image is mappable.
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t mem_size;  //Size passed to vpx2_init
+    uint32_t mem_bytes; //Size of the stored image (mem_size + tail pad in masked mode)
+
+    uint8_t err_code;
+    uint32_t err_val;
+    uint32_t err_pc_state;
+
+    uint32_t registers[64];
+
+    uint32_t ivt; //VPX_TRAPS state, 0 otherwise. Older snapshots have zeros here (padding).
+    uint32_t timer_period;
+    uint32_t timer_left;
+
+    uint32_t ctx_base; //VPX_ISA_CONTEXTS state, same deal.
+    uint32_t ctx_count;
+    uint32_t ctx_current;
+} vpx_snapshot_header;
+
+uint8_t snapshot_save(const char* path){
+    //Saves the currently loaded VM. Returns 0 on success.
+    stream_wait_all(); //Pages of a streamed image that haven't arrived would be saved as zeros.
+    vpx2_state st;
+    vpx2_state_save(&st);
+
+    uint8_t hdr_page[VPX_SNAP_HDR];
+    memset(hdr_page, 0, sizeof(hdr_page));
+
+    vpx_snapshot_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VPX_SNAP_MAGIC, 4);
+    hdr.version = VPX_SNAP_VERSION;
+    hdr.mem_size = st.mem_size;
+    hdr.mem_bytes = vpx2_mem_bytes(st.mem_size);
+    hdr.err_code = st.err_code;
+    hdr.err_val = st.err_val;
+    hdr.err_pc_state = st.err_pc_state;
+    memcpy(hdr.registers, st.registers, sizeof(hdr.registers));
+    #ifdef VPX_TRAPS
+    hdr.ivt = st.ivt;
+    hdr.timer_period = st.timer_period;
+    hdr.timer_left = st.timer_left;
+    #endif
+    #ifdef VPX_ISA_CONTEXTS
+    hdr.ctx_base = st.ctx_base;
+    hdr.ctx_count = st.ctx_count;
+    hdr.ctx_current = st.ctx_current;
+    #endif
+    memcpy(hdr_page, &hdr, sizeof(hdr));
+
+    FILE* file = fopen(path, "wb");
+    if(file == NULL){
+        return 1;
+    }
+    uint8_t fail = 0;
+    if(fwrite(hdr_page, 1, VPX_SNAP_HDR, file) != VPX_SNAP_HDR){fail = 1;}
+    if(!fail && fwrite(st.mem_ptr, 1, hdr.mem_bytes, file) != hdr.mem_bytes){fail = 1;}
+    if(fclose(file) != 0){fail = 1;}
+    return fail;
+}
+
+uint8_t* snapshot_restore(const char* path){
+    //Loads a snapshot into the VM. Returns the guest memory (owned by the caller,
+    //release it with snapshot_release) or NULL on failure.
+    FILE* file = fopen(path, "rb");
+    if(file == NULL){
+        return NULL;
+    }
+    vpx_snapshot_header hdr;
+    if(fread(&hdr, 1, sizeof(hdr), file) != sizeof(hdr)
+        || memcmp(hdr.magic, VPX_SNAP_MAGIC, 4) != 0
+        || hdr.version != VPX_SNAP_VERSION
+        || hdr.mem_bytes != vpx2_mem_bytes(hdr.mem_size)){
+        fclose(file);
+        return NULL;
+    }
+
+    #ifdef _WIN32
+    //No mmap here, plain copy.
+    uint8_t* mem_ptr = malloc(hdr.mem_bytes);
+    if(mem_ptr == NULL
+        || fseek(file, VPX_SNAP_HDR, SEEK_SET) != 0
+        || fread(mem_ptr, 1, hdr.mem_bytes, file) != hdr.mem_bytes){
+        free(mem_ptr);
+        fclose(file);
+        return NULL;
+    }
+    #else
+    //Private file mapping: copy-on-write, untouched pages come straight from the page cache.
+    //A truncated file would map fine and SIGBUS on the first touch past its end.
+    struct stat fs;
+    if(fstat(fileno(file), &fs) != 0 || (uint64_t)fs.st_size < (uint64_t)VPX_SNAP_HDR + hdr.mem_bytes){
+        fclose(file);
+        return NULL;
+    }
+    void* map = mmap(NULL, hdr.mem_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), VPX_SNAP_HDR);
+    if(map == MAP_FAILED){
+        fclose(file);
+        return NULL;
+    }
+    uint8_t* mem_ptr = map;
+    #endif
+    fclose(file); //The mapping keeps its own reference.
+
+    vpx2_state st;
+    memcpy(st.registers, hdr.registers, sizeof(st.registers));
+    st.mem_ptr = mem_ptr;
+    st.mem_size = hdr.mem_size;
+    st.err_code = hdr.err_code;
+    st.err_val = hdr.err_val;
+    st.err_pc_state = hdr.err_pc_state;
+    #ifdef VPX_TRAPS
+    st.ivt = hdr.ivt;
+    st.timer_period = hdr.timer_period;
+    st.timer_left = hdr.timer_left;
+    #endif
+    #ifdef VPX_ISA_CONTEXTS
+    st.ctx_base = hdr.ctx_base;
+    st.ctx_count = hdr.ctx_count;
+    st.ctx_current = hdr.ctx_current;
+    #endif
+    vpx2_state_load(&st);
+
+    return mem_ptr;
+}
+
+void snapshot_release(uint8_t* mem_ptr, uint32_t mem_size){
+    #ifdef _WIN32
+    (void)mem_size;
+    free(mem_ptr);
+    #else
+    munmap(mem_ptr, vpx2_mem_bytes(mem_size));
+    #endif
+}
@@ -0,0 +1,373 @@
+//[[ STREAMING ]]
+//Loads an image from a pipe (or anything else that can't seek) with a reader
+//thread, in file order, straight into guest memory.
+//With VPX_STREAM the VM starts as soon as the header is in, pages are marked in
+//vpx2_ready_map as they complete and the interpreter only stalls (vpx2_stream_wait)
+//when it touches one that hasn't arrived yet. Once the stream ends vpx2_streaming
+//is cleared and memory accesses go back to a single flag check. Without it the load simply
+//finishes before the VM starts.
+//
+//Raw images have no header so their memory size is unknown, they get
+//stream_mem bytes (vpx-run --mem). Containers must have their section data
+//in the same order as the file (image_pack does that).
+#ifndef _WIN32
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define VPX_STREAM_CHUNK (64 * 1024) //Bytes read per syscall for raw data.
+
+uint32_t stream_mem = 64u << 20; //Memory for raw images read from a pipe.
+
+int stream_fd = -1;
+uint64_t stream_pos = 0; //Bytes consumed from stream_fd
+char stream_magic[4]; //First bytes, already read to tell raw from container
+uint8_t* stream_mem_ptr = NULL;
+uint32_t stream_mem_size = 0;
+
+//Container being streamed
+uint8_t stream_container = 0;
+vpx_image_header stream_hdr;
+vpx_image_section* stream_secs = NULL;
+uint16_t* stream_pending = NULL; //Per page: sections that still have to fill it
+
+pthread_t stream_thread;
+pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stream_cond = PTHREAD_COND_INITIALIZER;
+uint8_t stream_done = 0;
+
+static uint32_t stream_read_some(void* dst, uint32_t len){
+    //Whatever the pipe has right now (at least 1 byte), 0 at EOF or on error.
+    ssize_t n = read(stream_fd, dst, len);
+    if(n <= 0){return 0;}
+    stream_pos += n;
+    return (uint32_t)n;
+}
+
+static uint8_t stream_read(void* dst, uint32_t len){
+    //Reads exactly len bytes. Returns 0 on success.
+    uint8_t* out = dst;
+    while(len > 0){
+        uint32_t n = stream_read_some(out, len);
+        if(n == 0){return 1;}
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint8_t stream_skip(uint64_t len){
+    uint8_t scratch[4096];
+    while(len > 0){
+        uint32_t n = len < sizeof(scratch) ? len : sizeof(scratch);
+        if(stream_read(scratch, n) != 0){return 1;}
+        len -= n;
+    }
+    return 0;
+}
+
+static void stream_publish(uint32_t page){
+    //Page contents are final.
+    #ifdef VPX_STREAM
+    __atomic_store_n(&vpx2_ready_map[page], 1, __ATOMIC_RELEASE);
+    #else
+    (void)page;
+    #endif
+}
+
+static void stream_wake(){
+    pthread_mutex_lock(&stream_lock);
+    pthread_cond_broadcast(&stream_cond);
+    pthread_mutex_unlock(&stream_lock);
+}
+
+static void stream_finish(){
+    //Everything is in (or the stream ended early, the rest stays zero).
+    #ifdef VPX_STREAM
+    uint32_t pages = VPX_MEM_PAGES(stream_mem_size);
+    for(uint32_t p = 0; p < pages; p++){
+        stream_publish(p);
+    }
+    __atomic_store_n(&vpx2_streaming, 0, __ATOMIC_RELEASE); //The interpreter stops checking pages.
+    #endif
+    pthread_mutex_lock(&stream_lock);
+    stream_done = 1;
+    pthread_cond_broadcast(&stream_cond);
+    pthread_mutex_unlock(&stream_lock);
+}
+
+void stream_wait(uint32_t adr, uint32_t len){
+    //vpx2_stream_wait, runs on the VM thread.
+    #ifdef VPX_STREAM
+    uint32_t first = adr >> VPX_PAGE_SHIFT;
+    uint32_t last = (adr + len - 1) >> VPX_PAGE_SHIFT;
+    pthread_mutex_lock(&stream_lock);
+    while(!stream_done && !(__atomic_load_n(&vpx2_ready_map[first], __ATOMIC_ACQUIRE)
+        && __atomic_load_n(&vpx2_ready_map[last], __ATOMIC_ACQUIRE))){
+        pthread_cond_wait(&stream_cond, &stream_lock);
+    }
+    pthread_mutex_unlock(&stream_lock);
+    #else
+    (void)adr;
+    (void)len;
+    #endif
+}
+
+void stream_wait_all(){
+    //Blocks until the whole image is in. Anything that copies guest memory (templates,
+    //snapshots, checkpoints) has to call it first: pages still on the way would be copied
+    //as zeros, the reader only ever fills the original buffer.
+    if(stream_fd < 0){return;} //Not streamed.
+    pthread_mutex_lock(&stream_lock);
+    while(!stream_done){
+        pthread_cond_wait(&stream_cond, &stream_lock);
+    }
+    pthread_mutex_unlock(&stream_lock);
+}
+
+static void stream_fail(const char* what){
+    //The VM may already be running on half an image, nothing sane to do but stop.
+    printf("failed to stream image: %s\n", what);
+    exit(1);
+}
+
+//[[ RAW ]]
+static void stream_raw(){
+    uint32_t bytes = vpx2_mem_bytes(stream_mem_size);
+    memcpy(stream_mem_ptr, stream_magic, 4);
+    uint32_t pos = 4;
+    while(1){
+        uint32_t want = bytes - pos < VPX_STREAM_CHUNK ? bytes - pos : VPX_STREAM_CHUNK;
+        if(want == 0){
+            uint8_t extra;
+            if(read(stream_fd, &extra, 1) > 0){stream_fail("image larger than --mem");}
+            break;
+        }
+        uint32_t n = stream_read_some(stream_mem_ptr + pos, want);
+        if(n == 0){break;} //EOF
+        uint32_t old_pages = pos >> VPX_PAGE_SHIFT;
+        pos += n;
+        uint32_t new_pages = pos >> VPX_PAGE_SHIFT;
+        if(new_pages != old_pages){
+            for(uint32_t p = old_pages; p < new_pages; p++){
+                stream_publish(p);
+            }
+            stream_wake();
+        }
+    }
+}
+
+//[[ CONTAINER ]]
+typedef struct {
+    const vpx_image_section* sec;
+    uint32_t next_page; //First page this section hasn't released yet
+} vpx_stream_progress;
+
+static void stream_progress(vpx_stream_progress* pr, uint32_t done){
+    //done bytes of the section (from its start address) are final,
+    //release every page the section has fully written.
+    const vpx_image_section* sec = pr->sec;
+    uint64_t end = (uint64_t)sec->addr + sec->mem_size;
+    uint64_t filled = (uint64_t)sec->addr + done;
+    uint32_t last_page = (end - 1) >> VPX_PAGE_SHIFT;
+    uint8_t woke = 0;
+    while(pr->next_page <= last_page){
+        uint64_t page_end = ((uint64_t)pr->next_page + 1) << VPX_PAGE_SHIFT;
+        if(filled < (page_end < end ? page_end : end)){break;}
+        if(--stream_pending[pr->next_page] == 0){
+            stream_publish(pr->next_page);
+            woke = 1;
+        }
+        pr->next_page++;
+    }
+    if(woke){stream_wake();}
+}
+
+static int stream_sec_cmp(const void* a, const void* b){
+    const vpx_image_section* x = a;
+    const vpx_image_section* y = b;
+    return x->file_offset < y->file_offset ? -1 : x->file_offset > y->file_offset;
+}
+
+static void stream_section(const vpx_image_section* sec){
+    uint8_t* dst = stream_mem_ptr + sec->addr;
+    vpx_stream_progress pr = {sec, sec->addr >> VPX_PAGE_SHIFT};
+
+    if(sec->flags & VPX_SECF_LZ){
+        vpx_lz_section lz;
+        if(sec->file_size < sizeof(lz) || stream_read(&lz, sizeof(lz)) != 0){stream_fail("truncated section");}
+        if(lz.raw_size > sec->mem_size || lz.chunk_size == 0 || lz.chunk_size > (64u << 20)
+            || lz.chunk_count != (uint32_t)(((uint64_t)lz.raw_size + lz.chunk_size - 1) / lz.chunk_size)
+            || (uint64_t)lz.chunk_count * 4 > sec->file_size - sizeof(lz)){
+            stream_fail("bad compressed section");
+        }
+        uint32_t* chunk_end = malloc((size_t)lz.chunk_count * 4 + 4);
+        uint8_t* buf = malloc(VPX_LZ_BOUND(lz.chunk_size));
+        if(chunk_end == NULL || buf == NULL){stream_fail("out of memory");}
+        if(stream_read(chunk_end, lz.chunk_count * 4) != 0){stream_fail("truncated section");}
+        uint32_t start = 0;
+        for(uint32_t i = 0; i < lz.chunk_count; i++){
+            uint32_t end = chunk_end[i];
+            if(end < start || end - start > VPX_LZ_BOUND(lz.chunk_size)){stream_fail("bad compressed section");}
+            if(stream_read(buf, end - start) != 0){stream_fail("truncated section");}
+            uint32_t raw_off = i * lz.chunk_size;
+            uint32_t raw_len = lz.raw_size - raw_off < lz.chunk_size ? lz.raw_size - raw_off : lz.chunk_size;
+            if(lz_decompress(buf, end - start, dst + raw_off, raw_len) != 0){stream_fail("bad compressed chunk");}
+            stream_progress(&pr, raw_off + raw_len);
+            start = end;
+        }
+        //Whatever is left of the section (padding in the file) gets skipped by the caller.
+        free(chunk_end);
+        free(buf);
+    }else{
+        uint32_t done = 0;
+        while(done < sec->file_size){
+            uint32_t want = sec->file_size - done < VPX_STREAM_CHUNK ? sec->file_size - done : VPX_STREAM_CHUNK;
+            uint32_t n = stream_read_some(dst + done, want);
+            if(n == 0){stream_fail("truncated section");}
+            done += n;
+            stream_progress(&pr, done);
+        }
+    }
+    stream_progress(&pr, sec->mem_size); //Zero tail was already there.
+}
+
+static void stream_container_body(){
+    uint16_t count = stream_hdr.section_count;
+    qsort(stream_secs, count, sizeof(vpx_image_section), stream_sec_cmp);
+    for(uint16_t i = 0; i < count; i++){
+        const vpx_image_section* sec = &stream_secs[i];
+        if(sec->file_size == 0){continue;}
+        if(sec->file_offset < stream_pos){stream_fail("sections overlap or are out of order");}
+        if(stream_skip(sec->file_offset - stream_pos) != 0){stream_fail("truncated image");}
+        if(sec->type == VPX_SEC_SYMTAB){
+            image_symtab = malloc(sec->file_size);
+            if(image_symtab == NULL || stream_read(image_symtab, sec->file_size) != 0){stream_fail("truncated symbol table");}
+            image_symtab_size = sec->file_size;
+            continue;
+        }
+        uint64_t section_start = stream_pos;
+        stream_section(sec);
+        if(stream_skip(section_start + sec->file_size - stream_pos) != 0){stream_fail("truncated image");}
+    }
+}
+
+static void* stream_reader(void* arg){
+    (void)arg;
+    if(stream_container){
+        stream_container_body();
+    }else{
+        stream_raw();
+    }
+    stream_finish();
+    return NULL;
+}
+
+uint8_t stream_load(int fd){
+    //Starts loading an image from fd and initializes the VM with it.
+    //Returns 0 once the VM can start (with VPX_STREAM that's before the image is complete).
+    stream_fd = fd;
+    char* magic = stream_magic;
+    if(stream_read(magic, 4) != 0){
+        printf("empty image stream\n");
+        return 1;
+    }
+
+    if(memcmp(magic, VPX_IMG_MAGIC, 4) == 0){
+        //[[ CONTAINER HEADER ]]
+        stream_container = 1;
+        memcpy(stream_hdr.magic, magic, 4);
+        if(stream_read((uint8_t*)&stream_hdr + 4, sizeof(stream_hdr) - 4) != 0 || image_check_header(&stream_hdr) != 0){
+            return 1;
+        }
+        uint16_t count = stream_hdr.section_count;
+        stream_secs = malloc(sizeof(vpx_image_section) * (count + 1));
+        if(stream_secs == NULL || stream_read(stream_secs, sizeof(vpx_image_section) * count) != 0){
+            printf("failed to read image sections\n");
+            return 1;
+        }
+        for(uint16_t i = 0; i < count; i++){
+            if(stream_secs[i].type != VPX_SEC_SYMTAB && image_check_section(&stream_hdr, &stream_secs[i]) != 0){
+                printf("bad image section %hu\n", i);
+                return 1;
+            }
+        }
+        #ifdef VPX_MASKED
+        stream_mem_size = vpx2_mem_pow2(stream_hdr.mem_size);
+        #else
+        stream_mem_size = stream_hdr.mem_size;
+        #endif
+    }else{
+        //[[ RAW ]]
+        #ifdef VPX_MASKED
+        stream_mem_size = vpx2_mem_pow2(stream_mem);
+        #else
+        stream_mem_size = stream_mem;
+        #endif
+    }
+    if(stream_mem_size == 0){
+        printf("bad memory size for streamed image\n");
+        return 1;
+    }
+
+    uint32_t bytes = vpx2_mem_bytes(stream_mem_size);
+    stream_mem_ptr = image_alloc(bytes);
+    uint32_t pages = VPX_MEM_PAGES(stream_mem_size);
+    #ifdef VPX_STREAM
+    vpx2_ready_map = calloc(1, pages);
+    #endif
+    stream_pending = calloc(pages, sizeof(uint16_t));
+    if(stream_mem_ptr == NULL || stream_pending == NULL
+        #ifdef VPX_STREAM
+        || vpx2_ready_map == NULL
+        #endif
+        ){
+        printf("failed to allocate memory for image: %u Bytes\n", bytes);
+        return 1;
+    }
+
+    if(stream_container){
+        //Pages no section writes to are ready right away (bss, stack, gaps).
+        for(uint16_t i = 0; i < stream_hdr.section_count; i++){
+            const vpx_image_section* sec = &stream_secs[i];
+            if(sec->type == VPX_SEC_SYMTAB || sec->file_size == 0 || sec->mem_size == 0){continue;}
+            uint32_t first = sec->addr >> VPX_PAGE_SHIFT;
+            uint32_t last = ((uint64_t)sec->addr + sec->mem_size - 1) >> VPX_PAGE_SHIFT;
+            for(uint32_t p = first; p <= last; p++){
+                stream_pending[p]++;
+            }
+        }
+        for(uint32_t p = 0; p < pages; p++){
+            if(stream_pending[p] == 0){stream_publish(p);}
+        }
+    }
+    //The last page of a raw image is published at EOF by stream_finish.
+
+    vpx2_init(stream_mem_ptr, stream_mem_size);
+    if(stream_container){
+        vpx2_wreg(VPX_RPC, stream_hdr.entry_pc);
+        vpx2_wreg(VPX_RSP, stream_hdr.initial_rsp);
+    }
+    #ifdef VPX_STREAM
+    vpx2_stream_wait = stream_wait;
+    vpx2_streaming = 1;
+    #endif
+
+    if(pthread_create(&stream_thread, NULL, stream_reader, NULL) != 0){
+        printf("failed to start image reader\n");
+        return 1;
+    }
+    #ifdef VPX_STREAM
+    pthread_detach(stream_thread);
+    #else
+    pthread_join(stream_thread, NULL); //No ready map, the VM can only start on a complete image.
+    #endif
+    return 0;
+}
+
+#else
+void stream_wait_all(){} //Images are never streamed here.
+#endif
@@ -0,0 +1,326 @@
+//[[ RECORD UDFS ]]
+//--udf <in> <out> runs a guest function once per record of the input file, on warmed VMs
+//that are reused from record to record. Records in both files are a u32 length (little
+//endian) followed by that many bytes.
+//The guest initializes, then does hostcall 36 with its record buffers. That's the warm
+//point: every record is a call (vpx2_call) from the registers it had there, to --udf-entry
+//(by default right after hostcall 36) with the record written to the input buffer, its
+//length in r0 and r60, its number in r1 and r59. The guest writes the result to the output
+//buffer and returns its length in r0, or does hostcall 37 with it in r60. Memory isn't
+//reset between records, state a guest keeps only ever sees the records of its own VM.
+//With VPX_HARTS the records are spread over --udf-threads threads, each with its own
+//copy-on-write clone of the warmed VM. Results are written in input order either way.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define VPX_UDF_CHUNK 256 //Records a thread takes at once
+#define VPX_UDF_AHEAD 4 //Chunks per thread that may wait for the writer
+
+const char* opt_udf_in = NULL; //--udf <in> <out>
+const char* opt_udf_out = NULL;
+uint32_t opt_udf_entry = 0; //--udf-entry <pc>, 0 is right after hostcall 36
+uint32_t opt_udf_threads = 0; //--udf-threads <n>, 0 is one per core
+
+uint8_t udf_ready = 0; //Hostcall 36 happened, the loaded VM is warm.
+uint32_t udf_in_addr = 0; //Guest buffers, from hostcall 36
+uint32_t udf_in_cap = 0;
+uint32_t udf_out_addr = 0;
+uint32_t udf_out_cap = 0;
+VPX_HART_LOCAL uint8_t udf_done = 0; //Hostcall 37 ended the run, result length in udf_result.
+VPX_HART_LOCAL uint32_t udf_result = 0;
+
+int32_t call_vm(uint32_t entry, const uint32_t* args, uint32_t argc, uint32_t* result);
+uint8_t vm_prepare();
+extern VPX_HART_LOCAL uint64_t blocks_run;
+
+uint32_t udf_setup(uint32_t in_addr, uint32_t in_cap, uint32_t out_addr, uint32_t out_cap){
+    //Hostcall 36. Returns 0 if the buffers are in guest memory.
+    if(opt_udf_in == NULL){
+        errno = ENOSYS; //Not started with --udf.
+        return VPX_IO_ERR;
+    }
+    if((uint64_t)in_addr + in_cap > vpx2_mem_size || (uint64_t)out_addr + out_cap > vpx2_mem_size){
+        errno = EFAULT;
+        return VPX_IO_ERR;
+    }
+    udf_in_addr = in_addr;
+    udf_in_cap = in_cap;
+    udf_out_addr = out_addr;
+    udf_out_cap = out_cap;
+    udf_ready = 1;
+    return 0;
+}
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+    uint8_t* buf; //Length prefixed results
+    size_t len;
+    size_t cap;
+    uint8_t done;
+} vpx_udf_chunk;
+
+const uint8_t* udf_input;
+uint64_t* udf_offsets; //Of every record's length prefix
+uint64_t udf_records = 0;
+vpx_udf_chunk* udf_chunks;
+uint32_t udf_chunk_count = 0;
+vpx2_state udf_warm; //Registers at the warm point, memory of the template
+uint32_t udf_entry = 0;
+
+uint32_t udf_next = 0; //Next chunk to take
+uint32_t udf_written = 0; //Chunks the writer is done with
+uint8_t udf_failed = 0;
+pthread_mutex_t udf_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t udf_moved = PTHREAD_COND_INITIALIZER;
+
+static uint32_t udf_r32(const uint8_t* p){
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint8_t udf_index(size_t size){
+    //Finds every record. Returns 0 if the file is well formed.
+    uint64_t count = 0;
+    for(uint64_t off = 0; off < size; count++){
+        if(size - off < 4){return 1;}
+        uint32_t len = udf_r32(udf_input + off);
+        if(size - off - 4 < len){return 1;}
+        off += 4 + (uint64_t)len;
+    }
+    udf_offsets = malloc((count + 1) * sizeof(uint64_t));
+    if(udf_offsets == NULL){return 1;}
+    uint64_t off = 0;
+    for(uint64_t i = 0; i < count; i++){
+        udf_offsets[i] = off;
+        off += 4 + (uint64_t)udf_r32(udf_input + off);
+    }
+    udf_records = count;
+    return 0;
+}
+
+static uint8_t udf_append(vpx_udf_chunk* c, const uint8_t* data, uint32_t len){
+    if(c->cap - c->len < 4 + (size_t)len){
+        size_t cap = c->cap * 2 > c->len + 4 + len ? c->cap * 2 : c->len + 4 + len;
+        uint8_t* buf = realloc(c->buf, cap);
+        if(buf == NULL){return 1;}
+        c->buf = buf;
+        c->cap = cap;
+    }
+    uint8_t* prefix = c->buf + c->len;
+    prefix[0] = len;
+    prefix[1] = len >> 8;
+    prefix[2] = len >> 16;
+    prefix[3] = len >> 24;
+    memcpy(c->buf + c->len + 4, data, len);
+    c->len += 4 + len;
+    return 0;
+}
+
+static uint8_t udf_chunk(uint32_t chunk){
+    //Runs the records of a chunk on the loaded VM. Returns 0 if all of them finished.
+    vpx_udf_chunk* c = &udf_chunks[chunk];
+    uint64_t first = (uint64_t)chunk * VPX_UDF_CHUNK;
+    uint64_t last = first + VPX_UDF_CHUNK < udf_records ? first + VPX_UDF_CHUNK : udf_records;
+    for(uint64_t i = first; i < last; i++){
+        uint32_t len = udf_r32(udf_input + udf_offsets[i]);
+        uint8_t* dst = len <= udf_in_cap ? vpx2_mem_host(udf_in_addr, len, 1) : VPXNULL;
+        if(dst == VPXNULL){
+            printf("record %llu is larger than the guest's %u Byte buffer\n", (unsigned long long)i, udf_in_cap);
+            return 1;
+        }
+        memcpy(dst, udf_input + udf_offsets[i] + 4, len);
+
+        memcpy(vpx2_registers, udf_warm.registers, sizeof(vpx2_registers));
+        vpx2_wreg(60, len);
+        vpx2_wreg(59, (uint32_t)i);
+        uint32_t args[2] = {len, (uint32_t)i};
+        uint32_t result[VPX_CALL_ARGS];
+        blocks_run = 0; //--max-blocks is per record.
+        udf_done = 0;
+        int32_t code = call_vm(udf_entry, args, 2, result);
+        if(code < 0 || (code == 1 && !udf_done)){
+            const char* why = code >= 0 ? "guest exited instead of finishing it" : opt_max_blocks != 0 && blocks_run >= opt_max_blocks ? "guest ran past --max-blocks" : "guest failed";
+            printf("record %llu: %s\n", (unsigned long long)i, why);
+            return 1;
+        }
+        if(code == 0){
+            udf_result = result[0];
+        }
+        const uint8_t* src = udf_result <= udf_out_cap ? vpx2_mem_host(udf_out_addr, udf_result, 0) : VPXNULL;
+        if(src == VPXNULL){
+            printf("record %llu: result of %u Bytes is larger than the guest's %u Byte buffer\n", (unsigned long long)i, udf_result, udf_out_cap);
+            return 1;
+        }
+        if(udf_append(c, src, udf_result) != 0){
+            printf("out of memory for results\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef VPX_HARTS
+static void udf_fail(){
+    pthread_mutex_lock(&udf_lock);
+    udf_failed = 1;
+    pthread_cond_broadcast(&udf_moved);
+    pthread_mutex_unlock(&udf_lock);
+}
+
+static void* udf_worker(void* arg){
+    //One thread with its own clone of the warm VM, takes chunks until there are none left.
+    const vpx_template* tpl = arg;
+    vpx2_state st;
+    if(clone_create(tpl, &st) != 0){
+        printf("failed to create a VM for a --udf thread\n");
+        udf_fail();
+        return NULL;
+    }
+    vpx2_state_load(&st);
+    uint8_t running = vm_prepare() == 0;
+    if(!running){
+        udf_fail(); //Still has to drop its clone below.
+    }
+    uint32_t ahead = opt_udf_threads * VPX_UDF_AHEAD;
+    while(running){
+        pthread_mutex_lock(&udf_lock);
+        while(!udf_failed && udf_next < udf_chunk_count && udf_next - udf_written >= ahead){
+            pthread_cond_wait(&udf_moved, &udf_lock); //Writer is behind, don't pile up results.
+        }
+        uint32_t chunk = udf_next;
+        if(udf_failed || chunk == udf_chunk_count){
+            pthread_mutex_unlock(&udf_lock);
+            break;
+        }
+        udf_next++;
+        pthread_mutex_unlock(&udf_lock);
+
+        if(udf_chunk(chunk) != 0){
+            udf_fail();
+            break;
+        }
+        pthread_mutex_lock(&udf_lock);
+        udf_chunks[chunk].done = 1;
+        pthread_cond_broadcast(&udf_moved);
+        pthread_mutex_unlock(&udf_lock);
+    }
+    clone_destroy(&st);
+    return NULL;
+}
+#endif
+
+static uint8_t udf_write(FILE* out, uint32_t chunk){
+    vpx_udf_chunk* c = &udf_chunks[chunk];
+    uint8_t rt = fwrite(c->buf, 1, c->len, out) != c->len;
+    free(c->buf);
+    c->buf = NULL;
+    return rt;
+}
+
+int32_t udf_run(){
+    //Runs every record of --udf's input, the loaded VM is at its warm point.
+    //Returns 0 or -1 on error.
+    int fd = open(opt_udf_in, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0){
+        printf("failed to open --udf input: %s\n", opt_udf_in);
+        return -1;
+    }
+    size_t size = info.st_size;
+    udf_input = size != 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : (const uint8_t*)"";
+    close(fd);
+    if(udf_input == MAP_FAILED || udf_index(size) != 0){
+        printf("--udf input isn't a list of length prefixed records: %s\n", opt_udf_in);
+        return -1;
+    }
+    FILE* out = fopen(opt_udf_out, "wb");
+    if(out == NULL){
+        printf("failed to open --udf output: %s\n", opt_udf_out);
+        return -1;
+    }
+    udf_chunk_count = (udf_records + VPX_UDF_CHUNK - 1) / VPX_UDF_CHUNK;
+    udf_chunks = calloc(udf_chunk_count + 1, sizeof(vpx_udf_chunk));
+    if(udf_chunks == NULL){
+        printf("failed to allocate --udf chunks\n");
+        fclose(out);
+        return -1;
+    }
+    vpx2_state_save(&udf_warm);
+    udf_entry = opt_udf_entry != 0 ? opt_udf_entry : vpx2_rreg(VPX_RPC);
+
+    uint8_t failed = 0;
+    #ifdef VPX_HARTS
+    uint32_t threads = opt_udf_threads != 0 ? opt_udf_threads : (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+    threads = threads > udf_chunk_count ? udf_chunk_count : threads;
+    #else
+    uint32_t threads = 1; //VM state is global, one VM at a time.
+    #endif
+    if(threads <= 1){
+        //Right here on the warm VM.
+        for(uint32_t i = 0; i < udf_chunk_count && !failed; i++){
+            failed = udf_chunk(i) != 0 || udf_write(out, i) != 0;
+        }
+    }else{
+        #ifdef VPX_HARTS
+        opt_udf_threads = threads;
+        vpx_template tpl;
+        if(template_create(&tpl) != 0){
+            printf("failed to create --udf template\n");
+            fclose(out);
+            return -1;
+        }
+        pthread_t* ids = calloc(threads, sizeof(pthread_t));
+        uint32_t started = 0;
+        while(ids != NULL && started < threads && pthread_create(&ids[started], NULL, udf_worker, &tpl) == 0){
+            started++;
+        }
+        if(started == 0){
+            printf("failed to start --udf threads\n");
+            failed = 1;
+        }
+        //[[ WRITER ]]
+        for(uint32_t i = 0; i < udf_chunk_count && !failed; i++){
+            pthread_mutex_lock(&udf_lock);
+            while(!udf_chunks[i].done && !udf_failed){
+                pthread_cond_wait(&udf_moved, &udf_lock);
+            }
+            failed = udf_failed;
+            pthread_mutex_unlock(&udf_lock);
+            if(!failed && udf_write(out, i) != 0){
+                udf_fail();
+                failed = 1;
+            }
+            pthread_mutex_lock(&udf_lock);
+            udf_written = i + 1;
+            pthread_cond_broadcast(&udf_moved);
+            pthread_mutex_unlock(&udf_lock);
+        }
+        for(uint32_t i = 0; i < started; i++){
+            pthread_join(ids[i], NULL);
+        }
+        failed |= udf_failed;
+        free(ids);
+        template_destroy(&tpl);
+        #endif
+    }
+    if(fclose(out) != 0 && !failed){
+        printf("failed to write --udf output: %s\n", opt_udf_out);
+        failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+#else
+int32_t udf_run(){
+    printf("--udf is only supported on linux\n");
+    return -1;
+}
+#endif